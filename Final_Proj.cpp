@@ -4,6 +4,8 @@
    The code was modified from the demo code given by Hunter at https://github.com/vha3/Hunter-Adams-RP2040-Demos/tree/master/Networking/CAN
    It has:
     1. Multiple treads (protothread_send: sending messages)
+                       (protothread_receive: decoding received frames)
+                       (protothread_consume: reading decoded frames)
                        (protothread_watchdog: preventing system hangs)
     2. Double cores (core 1 (core1_main()): sends messages, LED toggles for successful transmission)
                     (core 0 (main()): initializes sys_clk and LED, setup core1 for sending, setup receiving and watchdog)
@@ -23,7 +25,7 @@
 #include "can.h"
 
 
-#define NEW_PAYLOAD_LEN  5              // the length of payload here
+#define NEW_PAYLOAD_LEN  10             // the length of payload here (bytes)
 
 // ----------------------------------------------------------------------
 // Initialize CAN driver
@@ -49,41 +51,84 @@ static PT_THREAD (protothread_send(struct pt *pt))
     while(1) {
         // If packets remain . . .
         if (number_to_send) {
-            // Indicate that it is unsafe to transmit
-            demo_can.set_unsafe_to_tx( 1 ) ;
+            // Wait for a free TX slot (the driver sends queued frames
+            // back to back on its own)
+            PT_YIELD_UNTIL(pt, demo_can.get_tx_space() > 0) ;
             // Send a packet
             demo_can.sendPacket() ;
             // Decrement the remaining number of packets to send ;
             number_to_send -= 1 ;
 
-            // Randomize the payload WHILE previous packet is being sent
-            unsigned short new_payload[NEW_PAYLOAD_LEN];
-            for (int i = 0; i < NEW_PAYLOAD_LEN; ++i) {
-                new_payload[i] = ( unsigned short )( rand() & 0b0111111111111111 );
+            // Randomize the payload WHILE previous packets are being sent,
+            // writing it straight into the driver's payload buffer
+            can_payload new_payload = demo_can.acquire_payload();
+            for (unsigned int i = 0; (i < NEW_PAYLOAD_LEN) && (i < new_payload.size); ++i) {
+                new_payload.data[i] = ( unsigned char )( rand() & 0xFF );
             }
-            demo_can.set_payload( new_payload, NEW_PAYLOAD_LEN );
+            demo_can.commit_payload( NEW_PAYLOAD_LEN );
             
             // Print some data occasionally
             if (((number_to_send+1) % 1000)==0) {
                 printf("Sent: %d\n", demo_can.get_number_sent()) ;
                 printf("Received: %d\n", demo_can.get_number_received()) ;
-                printf("Rejected: %d\n\n", demo_can.get_number_missed()) ;
+                printf("Rejected: %d\n", demo_can.get_number_missed()) ;
+                printf("Filtered: %d\n", demo_can.get_number_filtered()) ;
+                printf("Overrun: %d\n", demo_can.get_number_overrun()) ;
+                printf("Dropped: %d\n\n", demo_can.get_number_dropped()) ;
             }
-            // Wait until it's safe to send again
-            while(demo_can.get_unsafe_to_tx()) {} ;
         }
         // If no packets remain, print some data
         else {
             sleep_ms(500) ;
             printf("Number sent: %d\n", demo_can.get_number_sent()) ;
             printf("Number received: %d\n", demo_can.get_number_received()) ;
-            printf("Number rejected: %d\n\n", demo_can.get_number_missed()) ;
+            printf("Number rejected: %d\n", demo_can.get_number_missed()) ;
+            printf("Number filtered: %d\n", demo_can.get_number_filtered()) ;
+            printf("Number overrun: %d\n", demo_can.get_number_overrun()) ;
+            printf("Number dropped: %d\n\n", demo_can.get_number_dropped()) ;
         }
     } 
 
     PT_END(pt);
 }
 
+// Thread runs on core 0. The RX interrupt only captures frames; they are
+// checked, counted and handed to the callback here.
+static PT_THREAD (protothread_receive(struct pt *pt))
+{
+    PT_BEGIN(pt);
+
+    while(1) {
+        PT_YIELD_UNTIL(pt, demo_can.rx_available()) ;
+        demo_can.processReceived() ;
+    }
+
+    PT_END(pt);
+}
+
+// Thread runs on core 0. Takes decoded frames off the driver's RX queue
+// (this could as well be on core 1), printing one now and then.
+static PT_THREAD (protothread_consume(struct pt *pt))
+{
+    PT_BEGIN(pt);
+
+    static can_rx_frame frame ;
+    static int number_consumed = 0 ;
+
+    while(1) {
+        PT_YIELD_UNTIL(pt, demo_can.rx_frame_ready()) ;
+        while (demo_can.rx_pop(&frame)) {
+            number_consumed += 1 ;
+            if ((number_consumed % 1000) == 0) {
+                printf("Frame to 0x%04x: %d bytes at %llu us\n\n", frame.arbitration,
+                       frame.len, (unsigned long long)frame.end_us) ;
+            }
+        }
+    }
+
+    PT_END(pt);
+}
+
 // Thread runs on core 0
 static PT_THREAD (protothread_watchdog(struct pt *pt))
 {
@@ -92,7 +137,8 @@ static PT_THREAD (protothread_watchdog(struct pt *pt))
     watchdog_enable(1000, 1);
 
     while(1) {
-        sleep_ms(100) ;
+        // Yield rather than sleep, so that received frames keep moving
+        PT_YIELD_usec(100000) ;
         watchdog_update();
     } 
 
@@ -118,8 +164,10 @@ void core1_main() {
 
 // Main for core 0
 int main() {
-    // Overclock to 160MHz (divides evenly to 1 megabaud) (160/5/32=1)
-    set_sys_clock_khz(OVERCLOCK_RATE, true) ;
+    // Overclock to a system clock that divides evenly to the bus bitrate
+    // (160MHz for 1 megabaud: 160/5/32=1), then derive the PIO divider
+    set_sys_clock_khz(CAN::sys_clock_khz(CAN_BITRATE), true) ;
+    demo_can.set_bitrate(CAN_BITRATE) ;
 
     // Initialize stdio
     stdio_init_all();
@@ -145,7 +193,9 @@ int main() {
     // Setup the CAN receiver on core 0
     demo_can.setupCANRX(rx_handler_wrapper) ;
 
-    // Add thread to scheduler, and start it
+    // Add threads to scheduler, and start them
+    pt_add_thread(protothread_receive) ;
+    pt_add_thread(protothread_consume) ;
     pt_add_thread(protothread_watchdog) ;
     pt_schedule_start ;
 }
@@ -0,0 +1,23 @@
+// =======================================================================
+// can.pio.h (host stub)
+// =======================================================================
+// Stands in for the header pioasm generates from can.pio.
+
+#ifndef BENCH_STUB_CAN_PIO_H
+#define BENCH_STUB_CAN_PIO_H
+
+#include "hardware/pio.h"
+
+static const pio_program_t idle_check_program = { 0, 0, -1 } ;
+static const pio_program_t can_tx_program     = { 0, 0, -1 } ;
+static const pio_program_t can_rx_program     = { 0, 0, -1 } ;
+
+// Public labels
+#define can_tx_offset_standby           0u
+#define can_tx_offset_check_collision   7u
+
+static inline void idle_check_program_init(PIO, uint, uint, uint, float) {}
+static inline void can_tx_program_init(PIO, uint, uint, uint, float) {}
+static inline void can_rx_program_init(PIO, uint, uint, uint, float) {}
+
+#endif  // BENCH_STUB_CAN_PIO_H
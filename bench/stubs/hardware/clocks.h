@@ -0,0 +1,17 @@
+// =======================================================================
+// hardware/clocks.h (host stub)
+// =======================================================================
+// The system clock is whatever the bench sets in clock_stub_hz.
+
+#ifndef BENCH_STUB_HARDWARE_CLOCKS_H
+#define BENCH_STUB_HARDWARE_CLOCKS_H
+
+#include <stdint.h>
+
+enum clock_index { clk_sys = 5 } ;
+
+inline uint32_t clock_stub_hz = 160000000 ;
+
+static inline uint32_t clock_get_hz(enum clock_index) { return clock_stub_hz ; }
+
+#endif  // BENCH_STUB_HARDWARE_CLOCKS_H
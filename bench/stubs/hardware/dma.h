@@ -0,0 +1,91 @@
+// =======================================================================
+// hardware/dma.h (host stub)
+// =======================================================================
+// Channel setup is recorded but nothing moves on its own: the TX and RX
+// streams are driven by the bench. A channel configured with trigger set
+// runs to completion immediately, through the sniffer model from
+// can_codec.h if sniffing is enabled, so the CAN_CRC_SNIFF paths give
+// real checksums.
+
+#ifndef BENCH_STUB_HARDWARE_DMA_H
+#define BENCH_STUB_HARDWARE_DMA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "can_codec.h"
+
+typedef unsigned int uint ;
+
+typedef struct { volatile uint32_t ints0, ints1 ; } dma_hw_t ;
+inline dma_hw_t dma_hw_stub ;
+#define dma_hw (&dma_hw_stub)
+
+enum dma_channel_transfer_size { DMA_SIZE_8 = 0, DMA_SIZE_16 = 1, DMA_SIZE_32 = 2 } ;
+
+typedef struct {
+    enum dma_channel_transfer_size size ;
+    bool read_increment ;
+    bool write_increment ;
+    bool sniff ;
+} dma_channel_config ;
+
+#define DREQ_PIO0_TX0   0
+#define DREQ_PIO0_TX1   1
+#define DREQ_PIO1_RX0   12
+
+#define DMA_SNIFF_CTRL_CALC_VALUE_CRC16  2
+
+inline crc16_sniffer dma_sniffer_stub ;
+
+static inline dma_channel_config dma_channel_get_default_config(uint) {
+    dma_channel_config c = { DMA_SIZE_32, true, false, false } ;
+    return c ;
+}
+static inline void channel_config_set_transfer_data_size(dma_channel_config * c, enum dma_channel_transfer_size size) { c->size = size ; }
+static inline void channel_config_set_read_increment(dma_channel_config * c, bool incr) { c->read_increment = incr ; }
+static inline void channel_config_set_write_increment(dma_channel_config * c, bool incr) { c->write_increment = incr ; }
+static inline void channel_config_set_sniff_enable(dma_channel_config * c, bool sniff) { c->sniff = sniff ; }
+static inline void channel_config_set_dreq(dma_channel_config *, uint) {}
+static inline void channel_config_set_chain_to(dma_channel_config *, uint) {}
+
+static inline void dma_channel_configure(uint, const dma_channel_config * c, volatile void * write_addr,
+                                         const volatile void * read_addr, uint count, bool trigger) {
+    if (!trigger) {
+        return ;
+    }
+    int size = 1 << c->size ;
+    volatile unsigned char * w = (volatile unsigned char *)write_addr ;
+    const volatile unsigned char * r = (const volatile unsigned char *)read_addr ;
+    for (uint i = 0; i < count; i++) {
+        unsigned int value = 0 ;
+        for (int k = 0; k < size; k++) {
+            // Little-endian, like the RP2040
+            value |= ((unsigned int)r[k]) << (8 * k) ;
+            w[k] = r[k] ;
+        }
+        if (c->sniff) {
+            crc16_sniff_transfer(&dma_sniffer_stub, value, size) ;
+        }
+        r += c->read_increment ? size : 0 ;
+        w += c->write_increment ? size : 0 ;
+    }
+}
+
+static inline void dma_start_channel_mask(uint32_t) {}
+static inline void dma_channel_abort(uint) {}
+static inline void dma_channel_wait_for_finish_blocking(uint) {}
+static inline void dma_channel_set_trans_count(uint, uint32_t, bool) {}
+static inline void dma_channel_set_read_addr(uint, const volatile void *, bool) {}
+static inline void dma_channel_set_write_addr(uint, volatile void *, bool) {}
+static inline void dma_channel_set_irq0_enabled(uint, bool) {}
+static inline void dma_channel_acknowledge_irq0(uint) {}
+static inline void dma_channel_set_irq1_enabled(uint, bool) {}
+static inline bool dma_channel_get_irq1_status(uint channel) { return (dma_hw->ints1 >> channel) & 1 ; }
+static inline void dma_channel_acknowledge_irq1(uint channel) { dma_hw->ints1 &= ~(1u << channel) ; }
+
+static inline void dma_sniffer_enable(uint, uint, bool) {}
+static inline void dma_sniffer_set_byte_swap_enabled(bool swap) { dma_sniffer_stub.bswap = swap ; }
+static inline void dma_sniffer_set_data_accumulator(uint32_t seed) { dma_sniffer_stub.data = seed ; }
+static inline uint32_t dma_sniffer_get_data_accumulator(void) { return dma_sniffer_stub.data ; }
+
+#endif  // BENCH_STUB_HARDWARE_DMA_H
@@ -0,0 +1,22 @@
+// =======================================================================
+// hardware/irq.h (host stub)
+// =======================================================================
+
+#ifndef BENCH_STUB_HARDWARE_IRQ_H
+#define BENCH_STUB_HARDWARE_IRQ_H
+
+#include <stdbool.h>
+
+typedef void (*irq_handler_t)(void) ;
+
+#define PIO0_IRQ_0  7
+#define PIO0_IRQ_1  8
+#define PIO1_IRQ_0  9
+#define DMA_IRQ_0   11
+#define DMA_IRQ_1   12
+
+static inline void irq_set_exclusive_handler(unsigned, irq_handler_t) {}
+static inline void irq_set_enabled(unsigned, bool) {}
+static inline void irq_clear(unsigned) {}
+
+#endif  // BENCH_STUB_HARDWARE_IRQ_H
@@ -0,0 +1,56 @@
+// =======================================================================
+// hardware/pio.h (host stub)
+// =======================================================================
+// Just enough of the Pico SDK PIO API for can.cpp to build on a host.
+// FIFOs and irq flags are plain memory, everything else does nothing.
+
+#ifndef BENCH_STUB_HARDWARE_PIO_H
+#define BENCH_STUB_HARDWARE_PIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef unsigned int uint ;
+
+typedef struct {
+    volatile uint32_t addr ;    // program counter, set by the bench
+} pio_sm_hw_t ;
+
+typedef struct {
+    volatile uint32_t txf[4] ;
+    volatile uint32_t rxf[4] ;
+    volatile uint32_t irq ;
+    pio_sm_hw_t sm[4] ;
+} pio_hw_t ;
+typedef pio_hw_t * PIO ;
+
+inline pio_hw_t pio_stub[2] ;
+#define pio0 (&pio_stub[0])
+#define pio1 (&pio_stub[1])
+
+typedef struct { uint32_t clkdiv ; } pio_sm_config ;
+typedef struct { const uint16_t * instructions ; uint8_t length ; int8_t origin ; } pio_program_t ;
+
+enum pio_interrupt_source { pis_interrupt0 = 8, pis_interrupt1, pis_interrupt2, pis_interrupt3 } ;
+
+static inline uint pio_add_program(PIO, const pio_program_t *) { return 0 ; }
+static inline void pio_sm_set_enabled(PIO, uint, bool) {}
+static inline void pio_interrupt_clear(PIO pio, uint irq) { pio->irq &= ~(1u << irq) ; }
+static inline bool pio_interrupt_get(PIO pio, uint irq) { return (pio->irq >> irq) & 1 ; }
+static inline void pio_set_irq0_source_enabled(PIO, enum pio_interrupt_source, bool) {}
+static inline void pio_set_irq1_source_enabled(PIO, enum pio_interrupt_source, bool) {}
+static inline void pio_sm_drain_tx_fifo(PIO, uint) {}
+static inline void pio_sm_clear_fifos(PIO, uint) {}
+static inline void pio_sm_restart(PIO, uint) {}
+static inline uint8_t pio_sm_get_pc(PIO pio, uint sm) { return (uint8_t)pio->sm[sm].addr ; }
+static inline uint pio_encode_jmp(uint addr) { return addr ; }
+static inline void pio_sm_exec(PIO pio, uint sm, uint instr) { pio->sm[sm].addr = instr ; }
+static inline void pio_gpio_init(PIO, uint) {}
+static inline void pio_sm_set_consecutive_pindirs(PIO, uint, uint, uint, bool) {}
+static inline void pio_sm_set_pins(PIO, uint, uint32_t) {}
+static inline void pio_sm_init(PIO, uint, uint, const pio_sm_config *) {}
+static inline void pio_sm_set_clkdiv(PIO, uint, float) {}
+static inline void pio_sm_clkdiv_restart(PIO, uint) {}
+static inline void pio_clkdiv_restart_sm_mask(PIO, uint32_t) {}
+
+#endif  // BENCH_STUB_HARDWARE_PIO_H
@@ -0,0 +1,23 @@
+// =======================================================================
+// hardware/sync.h (host stub)
+// =======================================================================
+// The bench is single threaded, so locks and barriers are no-ops.
+
+#ifndef BENCH_STUB_HARDWARE_SYNC_H
+#define BENCH_STUB_HARDWARE_SYNC_H
+
+#include <stdint.h>
+
+typedef volatile uint32_t spin_lock_t ;
+
+inline spin_lock_t spin_lock_stub[32] ;
+
+static inline spin_lock_t * spin_lock_instance(unsigned n) { return &spin_lock_stub[n] ; }
+static inline unsigned next_striped_spin_lock_num(void) { return 16 ; }
+static inline uint32_t spin_lock_blocking(spin_lock_t *) { return 0 ; }
+static inline void spin_unlock(spin_lock_t *, uint32_t) {}
+static inline uint32_t save_and_disable_interrupts(void) { return 0 ; }
+static inline void restore_interrupts(uint32_t) {}
+static inline void __dmb(void) {}
+
+#endif  // BENCH_STUB_HARDWARE_SYNC_H
@@ -0,0 +1,32 @@
+// =======================================================================
+// hardware/timer.h (host stub)
+// =======================================================================
+// Alarms never fire on their own. By default every target counts as
+// already missed, so the driver runs the expiry path straight away. With
+// alarm_stub_hold set the target is accepted instead, and the bench fires
+// the callback itself through alarm_stub_callback. Time only moves when
+// the bench sets time_stub_us.
+
+#ifndef BENCH_STUB_HARDWARE_TIMER_H
+#define BENCH_STUB_HARDWARE_TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef unsigned int uint ;
+typedef uint64_t absolute_time_t ;
+typedef void (*hardware_alarm_callback_t)(uint alarm_num) ;
+
+inline hardware_alarm_callback_t alarm_stub_callback[4] ;
+inline bool alarm_stub_hold = false ;
+inline uint64_t time_stub_us = 0 ;
+
+static inline int hardware_alarm_claim_unused(bool) { return 0 ; }
+static inline void hardware_alarm_set_callback(uint alarm_num, hardware_alarm_callback_t callback) {
+    alarm_stub_callback[alarm_num] = callback ;
+}
+static inline bool hardware_alarm_set_target(uint, absolute_time_t) { return !alarm_stub_hold ; }
+static inline uint64_t time_us_64(void) { return time_stub_us ; }
+static inline absolute_time_t from_us_since_boot(uint64_t us) { return us ; }
+
+#endif  // BENCH_STUB_HARDWARE_TIMER_H
@@ -0,0 +1,47 @@
+// =======================================================================
+// pico/stdlib.h (host stub)
+// =======================================================================
+
+#ifndef BENCH_STUB_PICO_STDLIB_H
+#define BENCH_STUB_PICO_STDLIB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hardware/timer.h"
+
+typedef unsigned int uint ;
+
+#define GPIO_OUT 1
+
+static inline void gpio_init(uint) {}
+static inline void gpio_set_dir(uint, bool) {}
+static inline void gpio_put(uint, bool) {}
+static inline bool gpio_get(uint) { return false ; }
+static inline void sleep_ms(uint32_t) {}
+static inline void sleep_us(uint64_t) {}
+static inline void tight_loop_contents(void) {}
+static inline absolute_time_t make_timeout_time_us(uint64_t us) { return time_us_64() + us ; }
+
+// Same search as the SDK: 12 MHz reference, VCO 750-1600 MHz, two post
+// dividers of 1-7
+static inline bool check_sys_clock_khz(uint32_t freq_khz, uint * vco_out, uint * postdiv1_out, uint * postdiv2_out) {
+    for (uint fbdiv = 320; fbdiv >= 16; fbdiv--) {
+        uint vco_khz = fbdiv * 12000 ;
+        if ((vco_khz < 750000) || (vco_khz > 1600000)) {
+            continue ;
+        }
+        for (uint postdiv1 = 7; postdiv1 >= 1; postdiv1--) {
+            for (uint postdiv2 = postdiv1; postdiv2 >= 1; postdiv2--) {
+                if (vco_khz == freq_khz * postdiv1 * postdiv2) {
+                    *vco_out = vco_khz * 1000 ;
+                    *postdiv1_out = postdiv1 ;
+                    *postdiv2_out = postdiv2 ;
+                    return true ;
+                }
+            }
+        }
+    }
+    return false ;
+}
+
+#endif  // BENCH_STUB_PICO_STDLIB_H
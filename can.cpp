@@ -1,28 +1,27 @@
 #include "hardware/pio.h"
 #include "hardware/dma.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+#include "hardware/clocks.h"
 #include "can.pio.h"
 #include "can.h"
+#include "can_codec.h"
 #include "pico/stdlib.h"
 #include "stdio.h"
 #include <string.h>
 
 
 // ----------------------------------------------------------------------
-// Define buffers for storing studded/unstuffed packets for TX/RX
+// Frame buffers (members of CAN, sized by MAX_PAYLOAD_SIZE)
 // ----------------------------------------------------------------------
 
-// Assembled packet for transmission (unstuffed then stuffed)
-unsigned short tx_packet_unstuffed[MAX_PACKET_LEN>>1] = {0} ;
-unsigned short tx_packet_stuffed[MAX_STUFFED_PACKET_LEN>>1] = {0} ;
-unsigned short * tx_packet_stuffed_pointer = &tx_packet_stuffed[0] ;
+// A TX slot is only reused once tx_handler has freed it, so encoding
+// never touches the buffer on the wire
+static_assert(TX_QUEUE_SLOTS >= 2, "TX_QUEUE_SLOTS must be at least 2 to encode during transmission") ;
 
-// Buffer for received packets (stuffed then unstuffed)
-unsigned char rx_packet_stuffed[MAX_STUFFED_PACKET_LEN] = {0} ;
-unsigned char rx_packet_unstuffed[MAX_PACKET_LEN] = {0} ;
-unsigned char * rx_packet_stuffed_pointer = &rx_packet_stuffed[0] ;
-
-// For re-initializing these buffers
-unsigned char zero_packet[MAX_STUFFED_PACKET_LEN] = {0} ;
+// Payload sent until the application sets its own
+static const unsigned char default_payload[] = {0x13, 0x35, 0x56, 0x78, 0x90, 0x12, 0x34, 0x56, 0x78, 0x90} ;
+#define DEFAULT_PAYLOAD_LEN ((MAX_PAYLOAD_SIZE < sizeof(default_payload)) ? MAX_PAYLOAD_SIZE : sizeof(default_payload))
 
 // ----------------------------------------------------------------------
 // Define infrastructure globals
@@ -35,15 +34,56 @@ PIO pio_1 = pio1 ;
 int can_tx_sm         = 0 ;
 int can_idle_check_sm = 1 ;
 int can_rx_sm         = 0 ;
+// Where the PIO0 programs were loaded
+uint can_idle_offset  = 0 ;
+uint can_tx_offset    = 0 ;
 // Select dma channels
 int dma_chan_0  = 0 ;
 int dma_chan_1  = 1 ;
 int dma_chan_2  = 2 ;
 int dma_chan_3  = 3 ;
 int dma_chan_4  = 4 ;
+int dma_chan_5  = 5 ;
+// Drivers set up for TX and RX (alarm, PIO and DMA irq callbacks carry
+// no context)
+CAN * tx_owner = NULL ;
+CAN * rx_owner = NULL ;
 // Dummy DMA source/destination for chained channel
 unsigned int dummy_source = 0 ;
 unsigned int dummy_dest   = 0 ;
+// Where the rest of a filtered-out frame goes
+unsigned char rx_discard  = 0 ;
+
+#if CAN_CRC_SNIFF
+// The DMA block has a single sniffer, shared by TX (core 1) and RX (core 0)
+spin_lock_t * sniff_lock ;
+
+// Reads count bytes from data through the sniffer on dma_chan_4 (into a
+// dummy word), starting from seed, and returns the CRC register.
+static unsigned short sniffCRC(const volatile void * data, unsigned int count, unsigned short seed) {
+    if (count == 0) {
+        return seed ;
+    }
+    uint32_t save = spin_lock_blocking(sniff_lock) ;
+
+    dma_channel_config c4 = dma_channel_get_default_config(dma_chan_4);
+    channel_config_set_transfer_data_size(&c4, DMA_SIZE_8);
+    channel_config_set_read_increment(&c4, true);
+    channel_config_set_write_increment(&c4, false);
+    channel_config_set_sniff_enable(&c4, true);
+
+    dma_sniffer_enable(dma_chan_4, DMA_SNIFF_CTRL_CALC_VALUE_CRC16, false) ;
+    dma_sniffer_set_byte_swap_enabled(false) ;
+    dma_sniffer_set_data_accumulator(seed) ;
+
+    dma_channel_configure(dma_chan_4, &c4, &dummy_dest, data, count, true);
+    dma_channel_wait_for_finish_blocking(dma_chan_4) ;
+    unsigned short crc = dma_sniffer_get_data_accumulator() & 0xFFFF ;
+
+    spin_unlock(sniff_lock, save) ;
+    return crc ;
+}
+#endif
 
 // ----------------------------------------------------------------------
 // Initialize CAN driver
@@ -54,19 +94,108 @@ CAN::CAN(unsigned short my_arbitration, unsigned short arbitration, unsigned sho
       arbitration( arbitration ),
       network_broadcast( network_broadcast ),
       tx_idle_time( 500 ),
+      bitrate( CAN_BITRATE ),
+      pio_clkdiv( CLKDIV << 8 ),
       reserve_byte( 0x55 ),
-      payload_len( 10 ),
+      payload_len( DEFAULT_PAYLOAD_LEN ),
+      rx_dma( 0 ),
+      rx_tail( 0 ),
+      rx_filtered( false ),
+      rx_queue_head( 0 ),
+      rx_queue_tail( 0 ),
+      header_cache_id( 0 ),
+      header_cache_valid( false ),
       number_sent( 0 ),
       number_received( 0 ),
       number_missed( 0 ),
-      unsafe_to_tx( 1 )
+      number_lost( 0 ),
+      number_failed( 0 ),
+      number_overrun( 0 ),
+      number_filtered( 0 ),
+      number_dropped( 0 ),
+      tx_seq( 0 ),
+      tx_active( -1 ),
+      tx_free( TX_QUEUE_SLOTS ),
+      tx_retry_limit( TX_RETRY_LIMIT ),
+      tx_timeout_us( TX_TIMEOUT_US ),
+      tx_lost( 0 ),
+      tx_start_us( 0 ),
+      tx_sof_us( 0 ),
+      tx_last(),
+      tx_alarm( -1 ),
+      tx_alarm_due( 0 ),
+      tx_guard( false ),
+      tx_deadline( false ),
+      rx_callback( NULL ),
+      rx_context( NULL )
 {
+    memset(payload, 0, sizeof(payload)) ;
+    memcpy(payload, default_payload, DEFAULT_PAYLOAD_LEN) ;
+    memset(tx_packet_stuffed, 0, sizeof(tx_packet_stuffed)) ;
+    memset(tx_packet_words, 0, sizeof(tx_packet_words)) ;
+    memset(rx_packet_stuffed, 0, sizeof(rx_packet_stuffed)) ;
+    memset(rx_packet_unstuffed, 0, sizeof(rx_packet_unstuffed)) ;
+    memset(rx_slot_us, 0, sizeof(rx_slot_us)) ;
+    // Frames for us and broadcasts
+    can_filter_clear(&rx_filter) ;
+    can_filter_add_id(&rx_filter, my_arbitration) ;
+    can_filter_add_id(&rx_filter, network_broadcast) ;
+    for (int k = 0; k < TX_QUEUE_SLOTS; k++) {
+        tx_slot_state[k] = TX_SLOT_FREE ;
+    }
+#if CAN_CRC_SNIFF
+    sniff_lock = spin_lock_instance(next_striped_spin_lock_num()) ;
+#endif
 }
 
 // ----------------------------------------------------------------------
 // Public accessor functions
 // ----------------------------------------------------------------------
 
+bool CAN::set_bitrate(unsigned int bitrate) {
+    if (bitrate == 0) {
+        return false ;
+    }
+    // Nearest 16.8 fixed point divider
+    uint64_t cycles = (uint64_t)PIO_CYCLES_PER_BIT * bitrate ;
+    uint64_t div = (((uint64_t)clock_get_hz(clk_sys) << 8) + (cycles >> 1)) / cycles ;
+    if ((div < (1u << 8)) || (div >= (65536u << 8))) {
+        return false ;
+    }
+    this->bitrate = bitrate ;
+    pio_clkdiv = (unsigned int)div ;
+
+    // Switch running machines over together. The divider is exact in a
+    // float (8 fractional bits).
+    float clkdiv = pio_clkdiv / 256.0f ;
+    if (tx_owner == this) {
+        pio_sm_set_clkdiv(pio_0, can_idle_check_sm, clkdiv) ;
+        pio_sm_set_clkdiv(pio_0, can_tx_sm, clkdiv) ;
+        pio_clkdiv_restart_sm_mask(pio_0, (1u << can_idle_check_sm) | (1u << can_tx_sm)) ;
+    }
+    if (rx_owner == this) {
+        pio_sm_set_clkdiv(pio_1, can_rx_sm, clkdiv) ;
+        pio_sm_clkdiv_restart(pio_1, can_rx_sm) ;
+    }
+    return true ;
+}
+
+unsigned int CAN::sys_clock_khz(unsigned int bitrate) {
+    if (bitrate == 0) {
+        return 0 ;
+    }
+    // Whole kHz that are a multiple of the PIO clock at one cycle per tick
+    uint64_t step = (uint64_t)PIO_CYCLES_PER_BIT * bitrate ;
+    uint vco, postdiv1, postdiv2 ;
+    for (uint64_t n = ((uint64_t)OVERCLOCK_RATE * 1000) / step; (n > 0) && (n * step >= (uint64_t)MIN_SYS_CLOCK * 1000); n--) {
+        uint64_t hz = n * step ;
+        if ((hz % 1000 == 0) && check_sys_clock_khz((uint32_t)(hz / 1000), &vco, &postdiv1, &postdiv2)) {
+            return (unsigned int)(hz / 1000) ;
+        }
+    }
+    return 0 ;
+}
+
 // ISR entered at the end of packet transmit
 void CAN::tx_handler() {
     // Abort/reset DMA channel, clear FIFO, clear PIO irq
@@ -74,389 +203,567 @@ void CAN::tx_handler() {
     // Toggle the LED
     gpio_put(LED_PIN, !gpio_get(LED_PIN)) ;
     number_sent += 1 ;
-    // Signal to thread that it is safe to transmit
-    unsafe_to_tx = 0 ;
+    // Free the slot. The next queued frame goes on the bus when the guard
+    // alarm fires, with no thread involvement.
+    int done = tx_active ;
+    can_tx_callback callback = tx_slot_callback[done] ;
+    void * context = tx_slot_context[done] ;
+    retireActive(TX_DONE) ;
+    tx_active = -1 ;
+    tx_guard = true ;
+    if (armAlarm(TX_GUARD_US)) {
+        // Already past it
+        guardElapsed() ;
+    }
+    // Report back to whoever queued it
+    if (callback) {
+        callback(&tx_last, context) ;
+    }
 }
 
-// ISR entered when a packet is available for attempted receipt
-void CAN::rx_handler() {
-    // Abort/reset DMA channel
-    resetReceiver() ;
-    // Attempt packet receipt
-    if (attemptPacketReceive()) {
-        number_received += 1 ;
-    } else {
-        number_missed += 1 ;
+// Points the TX alarm us microseconds ahead. Returns true if that time
+// has already passed, in which case the alarm will not fire.
+bool CAN::armAlarm(unsigned int us) {
+    tx_alarm_due = time_us_64() + us ;
+    return hardware_alarm_set_target(tx_alarm, from_us_since_boot(tx_alarm_due)) ;
+}
+
+// TX alarm callback (same core as tx_handler)
+static void tx_alarm_callback(uint) {
+    tx_owner->alarmElapsed() ;
+}
+
+// The alarm fired: end the guard or the deadline, whichever is running
+void CAN::alarmElapsed() {
+    // An interrupt left pending from before the alarm was moved can call
+    // back early. Wait for the real one.
+    if ((time_us_64() < tx_alarm_due) &&
+        !hardware_alarm_set_target(tx_alarm, from_us_since_boot(tx_alarm_due))) {
+        return ;
+    }
+    if (tx_guard) {
+        guardElapsed() ;
+    } else if (tx_deadline) {
+        deadlineElapsed() ;
     }
-    // Clear the interrupt to receive the next message
-    acceptNewPacket() ;
 }
 
-// Computes the checksum over a series of bytes
-unsigned short CAN::culCalcCRC(char crcData, unsigned short crcReg) {
-    for (int i = 0; i < 8; i++) {
-        if (((crcReg & 0x8000) >> 8) ^ (crcData & 0x80)) {
-            crcReg = (crcReg << 1) ^ CRC16_POLY;
-        } else {
-          crcReg = (crcReg << 1);
-        }
-        crcData <<= 1;
-    }
-    return crcReg;
-}
-
-// Packet transmission
-unsigned short CAN::getBitShort(unsigned short * shorty, unsigned char bitnum) {
-    switch(bitnum) {
-        case 0:
-            return ((*shorty & 0x8000) >> 15) ;
-        case 1:
-            return ((*shorty & 0x4000) >> 14) ;
-        case 2:
-            return ((*shorty & 0x2000) >> 13) ;
-        case 3:
-            return ((*shorty & 0x1000) >> 12) ;
-        case 4:
-            return ((*shorty & 0x0800) >> 11) ;
-        case 5:
-            return ((*shorty & 0x0400) >> 10) ;
-        case 6:
-            return ((*shorty & 0x0200) >> 9) ;
-        case 7:
-            return ((*shorty & 0x0100) >> 8) ;
-        case 8:
-            return ((*shorty & 0x0080) >> 7) ;
-        case 9:
-            return ((*shorty & 0x0040) >> 6) ;
-        case 10:
-            return ((*shorty & 0x0020) >> 5) ;
-        case 11:
-            return ((*shorty & 0x0010) >> 4) ;
-        case 12:
-            return ((*shorty & 0x0008) >> 3) ;
-        case 13:
-            return ((*shorty & 0x0004) >> 2) ;
-        case 14:
-            return ((*shorty & 0x0002) >> 1) ;
-        case 15:
-            return ((*shorty & 0x0001) >> 0) ;
-        default:
-            return 0xFFFF ;
-    }
-}
-
-void CAN::modifyBitShort(unsigned short * shorty, unsigned char bitnum, unsigned short value) {
-    switch(bitnum) {
-        case 15:
-            *shorty |= ((value << 0) & 0x0001) ;
-            break ;
-        case 14:
-            *shorty |= ((value << 1) & 0x0002) ;
-            break ;
-        case 13:
-            *shorty |= ((value << 2) & 0x0004) ;
-            break ;
-        case 12:
-            *shorty |= ((value << 3) & 0x0008) ;
-            break ;
-        case 11:
-            *shorty |= ((value << 4) & 0x0010) ;
-            break ;
-        case 10:
-            *shorty |= ((value << 5) & 0x0020) ;
-            break ;
-        case 9:
-            *shorty |= ((value << 6) & 0x0040) ;
-            break ;
-        case 8:
-            *shorty |= ((value << 7) & 0x0080) ;
-            break ;
-        case 7:
-            *shorty |= ((value << 8) & 0x0100) ;
-            break ;
-        case 6:
-            *shorty |= ((value << 9) & 0x0200) ;
-            break ;
-        case 5:
-            *shorty |= ((value << 10) & 0x0400) ;
-            break ;
-        case 4:
-            *shorty |= ((value << 11) & 0x0800) ;
-            break ;
-        case 3:
-            *shorty |= ((value << 12) & 0x1000) ;
-            break ;
-        case 2:
-            *shorty |= ((value << 13) & 0x2000) ;
-            break ;
-        case 1:
-            *shorty |= ((value << 14) & 0x4000) ;
-            break ;
-        case 0:
-            *shorty |= ((value << 15) & 0x8000) ;
-            break ;
-        default:
-            printf("Invalid argument to modifyBitChar   \n") ;
-            break ;
+// End of the post-frame guard: start the best queued frame, if any
+void CAN::guardElapsed() {
+    tx_guard = false ;
+    if (tx_active < 0) {
+        startNext() ;
     }
 }
 
-void CAN::bitStuff(unsigned short * unstuffed, unsigned short * stuffed) {
-    // Clear the buffer
-    memcpy(&stuffed[0], &zero_packet[0], MAX_STUFFED_PACKET_LEN) ;
+// The active frame is still not out at its deadline. If the TX machine
+// is waiting for the bus, give up on it; if the frame is already on the
+// wire, tx_handler finishes it as usual.
+void CAN::deadlineElapsed() {
+    tx_deadline = false ;
+    if ((tx_active >= 0) && preemptTransmit()) {
+        failActive(TX_TIMEOUT) ;
+    }
+}
 
-    // Variables for monitoring position in each buffer
-    int stuffed_index   = 0 ;
-    int unstuffed_index = 0 ;
-    int stuffed_bit     = 0 ;
-    int unstuffed_bit   = 0 ;
+// ISR entered when the idle check finds the bus idle (irq 2, which the TX
+// machine clears straight away) or the TX machine loses arbitration
+// (irq 3)
+void CAN::bus_handler() {
+    tx_owner->arbitrationLost() ;
+    tx_owner->busIdle() ;
+}
 
-    // Accumulated bit run length
-    int bit_run_len = 1 ;
+// If the TX machine went on from the idle bus to send SOF, this is the
+// start of the current attempt
+void CAN::busIdle() {
+    uint64_t now = time_us_64() ;
+    if ((tx_active >= 0) &&
+        ((pio_sm_get_pc(pio_0, can_tx_sm) - can_tx_offset) >= can_tx_offset_check_collision)) {
+        tx_sof_us = now ;
+    }
+}
 
-    // Memory of old bit value
-    unsigned short new_val = 0 ;
-    unsigned short old_val = 2 ;
+// The TX machine has already gone back to waiting for the bus. Take the
+// frame off it once the retry limit is used up.
+void CAN::arbitrationLost() {
+    // The flag may have been cleared by preemptTransmit meanwhile
+    if (!pio_interrupt_get(pio_0, 3)) {
+        return ;
+    }
+    pio_interrupt_clear(pio_0, 3) ;
+    number_lost += 1 ;
+    if (tx_active < 0) {
+        return ;
+    }
+    tx_lost += 1 ;
+    if ((tx_retry_limit >= 0) && (tx_lost > tx_retry_limit) && preemptTransmit()) {
+        failActive(TX_ARB_LOST) ;
+    }
+}
 
-    // Until we find the end of frame
-    while ((*(unstuffed + unstuffed_index) != 0xFFFF) && (unstuffed_index < MAX_PACKET_LEN)) {
-        new_val = getBitShort((unstuffed + unstuffed_index), unstuffed_bit) ;
-        bit_run_len = (new_val==old_val)?(bit_run_len+1):1 ;
-        old_val = new_val ;
+// Frees the slot of the active frame, which has been taken off the
+// transmitter, reports status for it and starts the next one. Nothing of
+// ours went out, so there is no guard to wait for.
+void CAN::failActive(can_tx_status status) {
+    int failed = tx_active ;
+    can_tx_callback callback = tx_slot_callback[failed] ;
+    void * context = tx_slot_context[failed] ;
+    retireActive(status) ;
+    number_failed += 1 ;
+    startNext() ;
+    if (callback) {
+        callback(&tx_last, context) ;
+    }
+}
 
-        if (bit_run_len < 5) {
-            modifyBitShort(stuffed+stuffed_index, stuffed_bit, new_val) ;
-            stuffed_bit = (stuffed_bit<15)?(stuffed_bit+1):0 ;
-            stuffed_index = (stuffed_bit==0)?(stuffed_index+1):stuffed_index ;
-            unstuffed_bit = (unstuffed_bit<15)?(unstuffed_bit+1):0 ;
-            unstuffed_index = (unstuffed_bit==0)?(unstuffed_index+1):unstuffed_index ;
+// Writes the completion record of the active frame and frees its slot
+void CAN::retireActive(can_tx_status status) {
+    int slot = tx_active ;
+    tx_last.end_us      = time_us_64() ;
+    tx_last.status      = status ;
+    tx_last.arbitration = tx_slot_id[slot] ;
+    tx_last.lost        = tx_lost ;
+    tx_last.queued_us   = tx_slot_queued_us[slot] ;
+    tx_last.start_us    = tx_start_us ;
+    tx_last.sof_us      = tx_sof_us ;
+    tx_slot_state[slot] = TX_SLOT_FREE ;
+    tx_free += 1 ;
+    tx_deadline = false ;
+}
+
+// ISR entered when a packet is available for attempted receipt. Only
+// captures the raw frame, so the RX machine is stalled for a few
+// microseconds; processReceived decodes it.
+void CAN::rx_handler() {
+    // Abort the DMA channel, and restart it on a free buffer
+    resetReceiver() ;
+    // Clear the interrupt to receive the next message
+    acceptNewPacket() ;
+}
 
+// RX worker: checks and delivers every captured frame, handing each slot
+// back to rx_handler as soon as it is done with it
+void CAN::processReceived() {
+    int tail = rx_tail ;
+    while (tail != rx_dma) {
+        // Attempt packet receipt
+        if (attemptPacketReceive(rx_packet_stuffed[tail])) {
+            number_received += 1 ;
+            if (rx_callback) {
+                rx_callback(&rx_packet_unstuffed[FRAME_HEADER_LEN], rx_packet_unstuffed[3], rx_context) ;
+            } else {
+                queueReceived(rx_slot_us[tail]) ;
+            }
         } else {
-            modifyBitShort(stuffed+stuffed_index, stuffed_bit, new_val) ;
-            stuffed_bit = (stuffed_bit<15)?(stuffed_bit+1):0 ;
-            stuffed_index = (stuffed_bit==0)?(stuffed_index+1):stuffed_index ;
-
-            modifyBitShort(stuffed+stuffed_index, stuffed_bit, !new_val) ;
-            stuffed_bit = (stuffed_bit<15)?(stuffed_bit+1):0 ;
-            stuffed_index = (stuffed_bit==0)?(stuffed_index+1):stuffed_index ;
-            unstuffed_bit = (unstuffed_bit<15)?(unstuffed_bit+1):0 ;
-            unstuffed_index = (unstuffed_bit==0)?(unstuffed_index+1):unstuffed_index ;
-
-            bit_run_len = 1 ;
-            old_val = !new_val ;
+            number_missed += 1 ;
         }
+        // Done reading it before rx_handler may hand it to the DMA channel
+        __dmb() ;
+        tail = (tail + 1) % RX_RING_SLOTS ;
+        rx_tail = tail ;
     }
+}
 
-    // Pack out rest of that index with zeroes
-    while(stuffed_bit <= 15) {
-        modifyBitShort(stuffed+stuffed_index, stuffed_bit, 0) ;
-        stuffed_bit += 1 ;
+// Copies the frame just decoded into the RX queue, or drops it if the
+// consumer has not kept up (counted apart from number_overrun, which
+// rx_handler updates)
+void CAN::queueReceived(uint64_t end_us) {
+    int head = rx_queue_head ;
+    int next = (head + 1) % RX_QUEUE_FRAMES ;
+    if (next == rx_queue_tail) {
+        number_dropped += 1 ;
+        return ;
     }
+    can_rx_frame * frame = &rx_queue[head] ;
+    frame->arbitration = (rx_packet_unstuffed[0] << 8) | rx_packet_unstuffed[1] ;
+    frame->len         = rx_packet_unstuffed[3] ;
+    frame->end_us      = end_us ;
+    memcpy(frame->data, &rx_packet_unstuffed[FRAME_HEADER_LEN], frame->len) ;
+    // Frame in memory before the consumer can see it
+    __dmb() ;
+    rx_queue_head = next ;
+}
 
-    // Postpend a short of all ones
-    stuffed_index += 1 ;
-    *(stuffed + stuffed_index) = *(unstuffed + unstuffed_index) ;
+bool CAN::rx_pop(can_rx_frame * frame) {
+    int tail = rx_queue_tail ;
+    if (tail == rx_queue_head) {
+        return false ;
+    }
+    // Index read before the frame it covers
+    __dmb() ;
+    *frame = rx_queue[tail] ;
+    // Done reading it before the worker may fill it again
+    __dmb() ;
+    rx_queue_tail = (tail + 1) % RX_QUEUE_FRAMES ;
+    return true ;
 }
 
-// Computes and appends the checksum, then appends the EOF.
-void CAN::sendPacket() {
-    int i ;
-    // Load arbitration
-    tx_packet_unstuffed[0] = arbitration ;
-    // Load reserve byte and payload length
-    tx_packet_unstuffed[1] =  (((((unsigned short)reserve_byte)<<8) & 0xFF00) |
-                             (((unsigned short)payload_len) & 0x00FF));
-    // Load payload
-    memcpy(&tx_packet_unstuffed[2], &payload[0], payload_len) ;
-    // Compute checksum
-    unsigned short checksum = CRC_INIT; // Init value for CRC calculation
-    while (checksum == 0xFFFF) {
-        tx_packet_unstuffed[1] ^= 0x8000 ;
-        for (i = 0; i < ((payload_len>>1)+2); i++) {
-          checksum = culCalcCRC((tx_packet_unstuffed[i]>>8)&0xFF, checksum);
-          checksum = culCalcCRC((tx_packet_unstuffed[i])&0xFF, checksum);
-        }
+// Computes the checksum over a series of bytes
+unsigned short CAN::culCalcCRC(char crcData, unsigned short crcReg) {
+    return crc16_byte(crcReg, (unsigned char)crcData) ;
+}
+
+// Stuffs the unstuffed frame (up to its all-ones EOF word) into stuffed
+void CAN::bitStuff(unsigned short * unstuffed, unsigned short * stuffed) {
+    // Find the end of frame
+    int unstuffed_index = 0 ;
+    while ((*(unstuffed + unstuffed_index) != 0xFFFF) && (unstuffed_index < (MAX_PACKET_LEN>>1)-1)) {
+        unstuffed_index += 1 ;
     }
+    can_bit_stuff(unstuffed, unstuffed_index, stuffed) ;
+}
 
-    // Load checksum
-    tx_packet_unstuffed[i] = checksum ;
-    // Load EOF
-    tx_packet_unstuffed[i+1] = 0xFFFF ;
+// Checksums and stuffs arbitration and the (toggled) reserve byte, and
+// keeps the encoder state so that frames to the same destination can
+// start from the length byte. Rebuilt when the destination changes.
+void CAN::cacheHeader(unsigned short id) {
+    can_encode_begin(&header_cache, header_cache_words) ;
+    can_encode_short(&header_cache, id) ;
+    can_encode_byte(&header_cache, reserve_byte ^ 0x80) ;
+    header_cache_id = id ;
+    header_cache_valid = true ;
+}
 
-    // Bit stuff the packet
-    bitStuff(tx_packet_unstuffed, tx_packet_stuffed) ;
+// Whether a caller's frame fits a TX slot. can_frame::len tops out at 255,
+// so at that capacity every frame does (and comparing would only warn).
+static inline bool payloadFits(const can_frame * frame) {
+#if MAX_PAYLOAD_SIZE < 255
+    return frame->len <= MAX_PAYLOAD_SIZE ;
+#else
+    (void)frame ;
+    return true ;
+#endif
+}
 
-    // BEGIN TRANSMISSION
-    dma_start_channel_mask((1u << dma_chan_0)) ;
+// Checksums and stuffs the payload bytes, two at a time
+static inline void encodePayload(can_encoder * enc, const unsigned char * payload, int len) {
+    int k = 0 ;
+    for (; k+1 < len; k += 2) {
+        can_encode_short(enc, (payload[k]<<8) | payload[k+1]) ;
+    }
+    if (k < len) {
+        can_encode_byte(enc, payload[k]) ;
+    }
 }
 
+// Checksums and stuffs the whole frame, up to the checksum, straight from
+// the payload
+void CAN::encodePacket(can_encoder * enc, unsigned short id, unsigned short header,
+                       const unsigned char * data, int len, unsigned short * out) {
+    can_encode_begin(enc, out) ;
+    can_encode_short(enc, id) ;
+    can_encode_short(enc, header) ;
+    encodePayload(enc, data, len) ;
+}
 
-// Packet reception
-unsigned char CAN::getBitChar(unsigned char * byte, unsigned char bitnum) {
-    switch(bitnum) {
-        case 0:
-            return ((*byte & 0x80) >> 7) ;
-        case 1:
-            return ((*byte & 0x40) >> 6) ;
-        case 2:
-            return ((*byte & 0x20) >> 5) ;
-        case 3:
-            return ((*byte & 0x10) >> 4) ;
-        case 4:
-            return ((*byte & 0x08) >> 3) ;
-        case 5:
-            return ((*byte & 0x04) >> 2) ;
-        case 6:
-            return ((*byte & 0x02) >> 1) ;
-        case 7:
-            return ((*byte & 0x01) >> 0) ;
-        default:
-            return 0xFF ;
-    }
-}
-
-void CAN::modifyBitChar(unsigned char * byte, unsigned char bitnum, unsigned char value) {
-    switch(bitnum) {
-        case 7:
-            *byte |= ((value << 0) & 0x01) ;
-            break ;
-        case 6:
-            *byte |= ((value << 1) & 0x02) ;
-            break ;
-        case 5:
-            *byte |= ((value << 2) & 0x04) ;
-            break ;
-        case 4:
-            *byte |= ((value << 3) & 0x08) ;
-            break ;
-        case 3:
-            *byte |= ((value << 4) & 0x10) ;
-            break ;
-        case 2:
-            *byte |= ((value << 5) & 0x20) ;
-            break ;
-        case 1:
-            *byte |= ((value << 6) & 0x40) ;
-            break ;
-        case 0:
-            *byte |= ((value << 7) & 0x80) ;
-            break ;
-        default:
-            printf("Invalid argument to modifyBitChar   \n") ;
-            break ;
-    }
-}
-
-// Unstuffs the first array and stores the result in the second.
-void CAN::unBitStuff(unsigned char * stuffed, unsigned char * unstuffed) {
-    // Clear the buffer
-    memcpy(&unstuffed[0], &zero_packet[0], MAX_STUFFED_PACKET_LEN) ;
-
-    // Variables for monitoring position in each buffer
-    int stuffed_index   = 0 ;
-    int unstuffed_index = 0 ;
-    int stuffed_bit     = 0 ;
-    int unstuffed_bit   = 0 ;
+// Encodes the frame into a free TX queue slot and queues it by priority.
+// Blocks while the queue is full. Call from the core that services
+// tx_handler.
+void CAN::sendPacket() {
+    while (tx_free == 0) {
+        tight_loop_contents() ;
+    }
+    queuePacket(arbitration, payload, payload_len, NULL, NULL) ;
+}
 
-    // Accumulated bit run length
-    int bit_run_len     = 0 ;
+// Same, for a frame the caller owns, without blocking. Returns false if
+// the queue is full or the payload is longer than MAX_PAYLOAD_SIZE.
+// Otherwise callback (if any) is called with context
+// from tx_handler, in interrupt context, once the frame is done.
+bool CAN::send_async(const can_frame * frame, can_tx_callback callback, void * context) {
+    if ((tx_free == 0) || !payloadFits(frame)) {
+        return false ;
+    }
+    queuePacket(frame->arbitration, frame->data, frame->len, callback, context) ;
+    return true ;
+}
 
-    // Memory of old bit value
-    unsigned char new_val = 0 ;
-    unsigned char old_val = 2 ;
+// Encodes a frame into a free slot (there must be one) and queues it
+void CAN::queuePacket(unsigned short id, const unsigned char * data, int len,
+                      can_tx_callback callback, void * context) {
+    // Only we claim slots, so this one stays free while we encode
+    int slot = 0 ;
+    while (tx_slot_state[slot] != TX_SLOT_FREE) {
+        slot += 1 ;
+    }
+    encodeSlot(slot, id, data, len) ;
 
-    // Until we find the end of frame . . .
-    while ((*(stuffed + stuffed_index) != 0xFF) && (stuffed_index < (MAX_STUFFED_PACKET_LEN))) {
-        // Get a new bit, update the bit run length, and update the bit memory
-        new_val = getBitChar((stuffed+stuffed_index), stuffed_bit) ;
-        bit_run_len = (new_val==old_val)?(bit_run_len+1):1 ;
-        old_val = new_val ;
+    uint32_t save = save_and_disable_interrupts() ;
+    queueSlot(slot, callback, context) ;
+    kickTransmit() ;
+    restore_interrupts(save) ;
+}
 
-        // If our bit run length is less than 5, update the unstuffed buffer
-        // and increment position in each buffer.
-        if (bit_run_len < 5) {
+// Queues n frames, encoding as many as there are free slots in one go and
+// handing each batch over under a single interrupt lock. Blocks until the
+// last one is queued; from there tx_handler sends them back to back.
+// Stops at the first frame longer than MAX_PAYLOAD_SIZE; returns how many
+// were queued.
+int CAN::sendBurst(const can_frame * frames, int n) {
+    int k = 0 ;
+    bool oversized = false ;
+    while ((k < n) && !oversized) {
+        while (tx_free == 0) {
+            tight_loop_contents() ;
+        }
+        int batch[TX_QUEUE_SLOTS] ;
+        int m = 0 ;
+        for (int slot = 0; (slot < TX_QUEUE_SLOTS) && (k+m < n); slot++) {
+            if (tx_slot_state[slot] == TX_SLOT_FREE) {
+                const can_frame * frame = &frames[k+m] ;
+                if (!payloadFits(frame)) {
+                    oversized = true ;
+                    break ;
+                }
+                encodeSlot(slot, frame->arbitration, frame->data, frame->len) ;
+                batch[m++] = slot ;
+            }
+        }
+        uint32_t save = save_and_disable_interrupts() ;
+        for (int j = 0; j < m; j++) {
+            queueSlot(batch[j], NULL, NULL) ;
+        }
+        kickTransmit() ;
+        restore_interrupts(save) ;
+        k += m ;
+    }
+    return k ;
+}
 
-            modifyBitChar(unstuffed+unstuffed_index, unstuffed_bit, new_val) ;
+// Checksums, stuffs and terminates a frame in the buffer of a free slot
+void CAN::encodeSlot(int slot, unsigned short id, const unsigned char * data, int len) {
+    unsigned short * out = tx_packet_stuffed[slot] ;
 
-            unstuffed_bit = (unstuffed_bit<7)?(unstuffed_bit+1):0 ;
-            unstuffed_index = (unstuffed_bit==0)?(unstuffed_index+1):unstuffed_index ;
+    // Start from the cached arbitration and reserve byte
+    if (!header_cache_valid || (header_cache_id != id)) {
+        cacheHeader(id) ;
+    }
+    can_encoder enc ;
+    can_encode_resume(&enc, &header_cache, header_cache_words, out) ;
+#if CAN_CRC_SNIFF
+    // Run the payload through the DMA sniffer, which checksums it in
+    // place. The header is folded into the seed in software.
+    unsigned short checksum = sniffCRC(data, len, crc16_byte(enc.crc, len)) ;
+    can_stuff_byte(&enc.st, len) ;
+    for (int k = 0; k < len; k++) {
+        can_stuff_byte(&enc.st, data[k]) ;
+    }
+    enc.crc = checksum ;
+#else
+    // Checksum and stuff length and payload in one pass
+    can_encode_byte(&enc, len) ;
+    encodePayload(&enc, data, len) ;
+#endif
+    // Bit 15 of the header is flipped on the way out, unless that makes
+    // the checksum all ones. Then the frame is encoded again without it.
+    if (enc.crc == 0xFFFF) {
+        encodePacket(&enc, id, (((unsigned short)reserve_byte)<<8) | len, data, len, out) ;
+    }
+    // Append checksum, padding and EOF
+    tx_packet_words[slot] = can_encode_end(&enc, out) ;
+    tx_slot_id[slot] = id ;
+}
 
-            stuffed_bit = (stuffed_bit<7)?(stuffed_bit+1):0 ;
-            stuffed_index = (stuffed_bit==0)?(stuffed_index+1):stuffed_index ;
+// Marks an encoded slot as waiting for the bus. Interrupts must be off.
+void CAN::queueSlot(int slot, can_tx_callback callback, void * context) {
+    tx_slot_seq[slot]       = tx_seq++ ;
+    tx_slot_callback[slot]  = callback ;
+    tx_slot_context[slot]   = context ;
+    tx_slot_queued_us[slot] = time_us_64() ;
+    tx_slot_state[slot]     = TX_SLOT_QUEUED ;
+    tx_free -= 1 ;
+}
 
-        } else {
-            modifyBitChar(unstuffed+unstuffed_index, unstuffed_bit, new_val) ;
-            unstuffed_bit = (unstuffed_bit<7)?(unstuffed_bit+1):0 ;
-            unstuffed_index = (unstuffed_bit==0)?(unstuffed_index+1):unstuffed_index ;
-
-            stuffed_bit = (stuffed_bit<7)?(stuffed_bit+1):0 ;
-            stuffed_index = (stuffed_bit==0)?(stuffed_index+1):stuffed_index ;
-            stuffed_bit = (stuffed_bit<7)?(stuffed_bit+1):0 ;
-            stuffed_index = (stuffed_bit==0)?(stuffed_index+1):stuffed_index ;
-
-            // Reset bit run length
-            bit_run_len = 1 ;
-            // We jumped over a stuffed bit, opposite polarity to
-            // the last bit that we measured
-            old_val = !new_val ;
+// After queueing: BEGIN TRANSMISSION if the bus side is idle, or in place
+// of a lower priority frame that has not started yet. Otherwise
+// tx_handler or the guard alarm starts the queued frames in turn.
+// Interrupts must be off.
+void CAN::kickTransmit() {
+    if (tx_active < 0) {
+        if (!tx_guard) {
+            startNext() ;
         }
+        return ;
+    }
+    int urgent = 0 ;
+    for (int k = 0; k < TX_QUEUE_SLOTS; k++) {
+        if ((tx_slot_state[k] == TX_SLOT_QUEUED) && (tx_slot_id[k] < tx_slot_id[tx_active])) {
+            urgent = 1 ;
+        }
+    }
+    if (urgent && preemptTransmit()) {
+        tx_slot_state[tx_active] = TX_SLOT_QUEUED ;
+        tx_deadline = false ;
+        startNext() ;
     }
-
 }
 
-// Check packet is valid (remain in rx_packet_unstuffed) or invalid.
-unsigned char CAN::attemptPacketReceive() {
-    int i ;
+// Starts the queued frame with the lowest arbitration (oldest first among
+// equals), or marks the transmitter idle. Interrupts must be off.
+void CAN::startNext() {
+    int best = -1 ;
+    for (int k = 0; k < TX_QUEUE_SLOTS; k++) {
+        if ((tx_slot_state[k] == TX_SLOT_QUEUED) &&
+            ((best < 0) || (tx_slot_id[k] < tx_slot_id[best]) ||
+             ((tx_slot_id[k] == tx_slot_id[best]) &&
+              ((int)(tx_slot_seq[k] - tx_slot_seq[best]) < 0)))) {
+            best = k ;
+        }
+    }
+    tx_active = best ;
+    if (best >= 0) {
+        tx_slot_state[best] = TX_SLOT_ACTIVE ;
+        startTransmit(best) ;
+    }
+}
 
-    // Unstuff the received packet
-    unBitStuff(rx_packet_stuffed, rx_packet_unstuffed) ;
+// Points the TX DMA channel at a queue slot and starts it, with a fresh
+// retry count and deadline
+void CAN::startTransmit(int slot) {
+    tx_lost = 0 ;
+    tx_start_us = time_us_64() ;
+    tx_sof_us = 0 ;
+    // A deadline too short to arm is treated as none
+    tx_deadline = (tx_timeout_us > 0) && !armAlarm(tx_timeout_us) ;
+    dma_channel_set_trans_count(dma_chan_0, tx_packet_words[slot], false) ;
+    dma_channel_set_read_addr(dma_chan_0, tx_packet_stuffed[slot], true) ;
+}
 
-    // Check arbitration bits
-    if ((rx_packet_unstuffed[0]!=((my_arbitration>>8)&0xFF))&&
-        (rx_packet_unstuffed[0]!=((network_broadcast>>8)&0xFF))) {
-        return 0 ;
+// Takes the active frame back off the transmitter, if the TX machine is
+// still waiting for an idle bus (or lost arbitration and is waiting
+// again). Returns false, touching nothing, once it has won the bus.
+// Interrupts must be off.
+bool CAN::preemptTransmit() {
+    // Cheap check first, so a frame on the wire is never stalled
+    if ((pio_sm_get_pc(pio_0, can_tx_sm) - can_tx_offset) >= can_tx_offset_check_collision) {
+        return false ;
     }
-    if ((rx_packet_unstuffed[1]!=((my_arbitration)&0xFF))&&
-        (rx_packet_unstuffed[1]!=((network_broadcast)&0xFF))) {
-        return 0 ;
+    // Stop the machine, then make sure it did not get past the wait
+    pio_sm_set_enabled(pio_0, can_tx_sm, false) ;
+    if ((pio_sm_get_pc(pio_0, can_tx_sm) - can_tx_offset) >= can_tx_offset_check_collision) {
+        pio_sm_set_enabled(pio_0, can_tx_sm, true) ;
+        return false ;
     }
+    pio_sm_set_enabled(pio_0, can_idle_check_sm, false) ;
 
-    // Check packet length
-    if (rx_packet_unstuffed[3] > MAX_PAYLOAD_SIZE) {
-        // printf("Invalid packet length\n") ;
-        return 0 ;
-    }
+    // Drop what the DMA channel already pushed
+    dma_channel_abort(dma_chan_0) ;
+    pio_sm_clear_fifos(pio_0, can_tx_sm) ;
+
+    // Send both machines back to the start, and clear the handshake
+    // between them (irq 1: TX waiting, irq 2: bus idle) and any lost
+    // arbitration not yet counted (irq 3). x is already zero while the
+    // TX machine waits, as standby expects.
+    pio_sm_restart(pio_0, can_tx_sm) ;
+    pio_sm_exec(pio_0, can_tx_sm, pio_encode_jmp(can_tx_offset + can_tx_offset_standby)) ;
+    pio_sm_restart(pio_0, can_idle_check_sm) ;
+    pio_sm_exec(pio_0, can_idle_check_sm, pio_encode_jmp(can_idle_offset)) ;
+    pio_interrupt_clear(pio_0, 1) ;
+    pio_interrupt_clear(pio_0, 2) ;
+    pio_interrupt_clear(pio_0, 3) ;
 
-    // Compute and check checksum
-    unsigned short checksum = CRC_INIT; // Init value for CRC calculation
-    for (i = 0; i < (rx_packet_unstuffed[3]+4); i++) {
-      checksum = culCalcCRC((rx_packet_unstuffed[i])&0xFF, checksum);
-    }
-    if ((rx_packet_unstuffed[i]==((checksum>>8)&0xFF)) &&
-        (rx_packet_unstuffed[i+1]==((checksum)&0xFF))) {
-        return 1 ;
-    } else {
+    pio_sm_set_enabled(pio_0, can_idle_check_sm, true) ;
+    pio_sm_set_enabled(pio_0, can_tx_sm, true) ;
+    return true ;
+}
+
+
+// Packet reception
+// Unstuffs the first array and stores the result in the second. Returns the
+// number of bytes recovered before the EOF or a stuff-rule violation.
+int CAN::unBitStuff(unsigned char * stuffed, unsigned char * unstuffed) {
+    int violation ;
+    return can_bit_unstuff(stuffed, MAX_STUFFED_PACKET_LEN, unstuffed, MAX_PACKET_LEN, &violation) ;
+}
+
+// Check packet is valid (remain in rx_packet_unstuffed) or invalid.
+// Destuffing, ID filter, length check and checksum run as a single pass,
+// which gives up as soon as the frame turns out not to be ours.
+unsigned char CAN::attemptPacketReceive(const unsigned char * stuffed) {
+#if CAN_CRC_SNIFF
+    if (can_decode_frame(stuffed, MAX_STUFFED_PACKET_LEN, rx_packet_unstuffed,
+                         MAX_PAYLOAD_SIZE, &rx_filter, 0) != RX_OK) {
         return 0 ;
     }
+    // Running the sniffer over the data and the received checksum leaves
+    // zero in the CRC register when they agree.
+    int i = rx_packet_unstuffed[3]+4 ;
+    return sniffCRC(rx_packet_unstuffed, i+2, CRC_INIT) == 0 ;
+#else
+    return can_decode_frame(stuffed, MAX_STUFFED_PACKET_LEN, rx_packet_unstuffed,
+                            MAX_PAYLOAD_SIZE, &rx_filter, 1) == RX_OK ;
+#endif
 }
 
 // Deive ISR
-// resets the DMA channel when overrun on the RX DMA channel (a new node joins the network) 
+// resets the DMA channels when overrun on the RX DMA channel (a new node joins the network) 
 void CAN::dma_handler() {
     // Clear the interrupt request
-    dma_hw->ints0 = 1u << dma_chan_1;
-    // Reset the DMA channel write address, and start the channel
-    dma_channel_set_write_addr(dma_chan_1, rx_packet_stuffed_pointer, true) ;
+    dma_hw->ints0 = 1u << dma_chan_5;
+    // Start again at the beginning of the slot
+    rx_owner->armReceiver() ;
+}
+
+// DMA ISR, entered once the header channel has the first RX_HEADER_BYTES
+// of a frame (the body channel is already collecting the rest)
+void CAN::header_handler() {
+    // A header interrupt still pending in the NVIC after rx_handler has
+    // moved on belongs to a frame already dealt with: the channel status
+    // tells it apart from a real one
+    if (!dma_channel_get_irq1_status(dma_chan_1)) {
+        return ;
+    }
+    // Clear the interrupt request
+    dma_channel_acknowledge_irq1(dma_chan_1);
+    rx_owner->filterHeader() ;
+}
+
+// Destuffs the ID out of the header bytes. If the acceptance filter turns
+// it down, the body channel is pointed at a dummy byte for the rest of the
+// frame and rx_handler drops it, so it never reaches the RX worker.
+void CAN::filterHeader() {
+    const unsigned char * header = rx_packet_stuffed[rx_dma] ;
+    can_destuffer ds ;
+    can_destuff_begin(&ds) ;
+    unsigned char id[2] ;
+    int count = 0 ;
+    for (int i = 0; (i < RX_HEADER_BYTES) && (count < 2); i++) {
+        if (!can_destuff_byte(&ds, header[i])) {
+            // Not a frame; the worker will say so
+            return ;
+        }
+        while ((count < 2) && can_destuff_pop(&ds, &id[count])) {
+            count += 1 ;
+        }
+    }
+    if ((count < 2) || can_filter_match(&rx_filter, (unsigned short)((id[0] << 8) | id[1]))) {
+        return ;
+    }
+    // Keep draining the PIO, so it stays in step with the bus, but into
+    // one byte
+    dma_channel_config c5 = dma_channel_get_default_config(dma_chan_5);
+    channel_config_set_transfer_data_size(&c5, DMA_SIZE_8);
+    channel_config_set_read_increment(&c5, false);
+    channel_config_set_write_increment(&c5, false);
+    channel_config_set_dreq(&c5, DREQ_PIO1_RX0) ;
+    dma_channel_set_irq0_enabled(dma_chan_5, false);
+    dma_channel_abort(dma_chan_5);
+    dma_channel_acknowledge_irq0(dma_chan_5);
+    dma_channel_set_irq0_enabled(dma_chan_5, true);
+    dma_channel_configure(dma_chan_5, &c5, &rx_discard, &pio_1->rxf[can_rx_sm],
+                          MAX_STUFFED_PACKET_LEN - RX_HEADER_BYTES, true) ;
+    rx_filtered = true ;
 }
 
 
 // Setup CAN
 void CAN::setupIdleCheck() {
     // Load PIO program onto PIO0
-    uint can_idle_offset = pio_add_program(pio_0, &idle_check_program) ;
+    can_idle_offset = pio_add_program(pio_0, &idle_check_program) ;
 
     // Initialize the PIO program
-    idle_check_program_init(pio_0, can_idle_check_sm, can_idle_offset, CAN_TX+1, CLKDIV) ;
+    idle_check_program_init(pio_0, can_idle_check_sm, can_idle_offset, CAN_TX+1, pio_clkdiv / 256.0f) ;
 
     // Zero the irq 1
     pio_interrupt_clear(pio_0, 1) ;
@@ -509,10 +816,15 @@ void CAN::setupCANTX(irq_handler_t handler) {
     setupIdleCheck() ;
 
     // Load PIO programs onto PIO0
-    uint can_tx_offset = pio_add_program(pio_0, &can_tx_program) ;
+    can_tx_offset = pio_add_program(pio_0, &can_tx_program) ;
 
     // Initialize the PIO program
-    can_tx_program_init(pio_0, can_tx_sm, can_tx_offset, CAN_TX, CLKDIV) ;
+    can_tx_program_init(pio_0, can_tx_sm, can_tx_offset, CAN_TX, pio_clkdiv / 256.0f) ;
+
+    // Claim an alarm on this core for the post-frame guard and deadlines
+    tx_owner = this ;
+    tx_alarm = hardware_alarm_claim_unused(true) ;
+    hardware_alarm_set_callback(tx_alarm, tx_alarm_callback) ;
 
     // Setup interrupts for TX machine
     pio_interrupt_clear(pio_0, 0) ;
@@ -520,6 +832,14 @@ void CAN::setupCANTX(irq_handler_t handler) {
     irq_set_exclusive_handler(PIO0_IRQ_0, handler) ;
     irq_set_enabled(PIO0_IRQ_0, true) ;
 
+    // Idle bus (irq 2) and lost arbitration (irq 3) on the other PIO0
+    // interrupt line
+    pio_interrupt_clear(pio_0, 3) ;
+    pio_set_irq1_source_enabled(pio_0, pis_interrupt2, true) ;
+    pio_set_irq1_source_enabled(pio_0, pis_interrupt3, true) ;
+    irq_set_exclusive_handler(PIO0_IRQ_1, bus_handler) ;
+    irq_set_enabled(PIO0_IRQ_1, true) ;
+
     // Channel Zero (sends data to TX PIO machine)
     dma_channel_config c0 = dma_channel_get_default_config(dma_chan_0);
     channel_config_set_transfer_data_size(&c0, DMA_SIZE_16);
@@ -531,8 +851,8 @@ void CAN::setupCANTX(irq_handler_t handler) {
         dma_chan_0,                     // Channel to be configured
         &c0,                            // The configuration we just created
         &pio_0->txf[can_tx_sm],         // write address (transmit PIO TX FIFO)
-        tx_packet_stuffed_pointer,      // read address (start of stuffed packet)
-        sizeof(tx_packet_stuffed)>>1,   // Number of transfers (aborts early!)
+        tx_packet_stuffed[0],           // read address (set per frame by startTransmit)
+        MAX_STUFFED_PACKET_LEN>>1,      // Number of transfers (set per frame)
         false                           // Don't start immediately.
     );
 
@@ -548,11 +868,14 @@ void CAN::setupCANTX(irq_handler_t handler) {
 
 // Set up CAN RX machine
 void CAN::setupCANRX(irq_handler_t handler) {
+    // The DMA overrun handler restarts the channel into our buffer
+    rx_owner = this ;
+
     // Load pio program onto PIO 1
     uint can_rx_offset = pio_add_program(pio_1, &can_rx_program) ;
 
     // Initialize the PIO programs
-    can_rx_program_init(pio_1, can_rx_sm, can_rx_offset, CAN_TX+1, CLKDIV) ;
+    can_rx_program_init(pio_1, can_rx_sm, can_rx_offset, CAN_TX+1, pio_clkdiv / 256.0f) ;
 
     // Setup interrupts for RX machine
     pio_interrupt_clear(pio_1, 0) ;
@@ -560,24 +883,33 @@ void CAN::setupCANRX(irq_handler_t handler) {
     irq_set_exclusive_handler(PIO1_IRQ_0, handler) ;
     irq_set_enabled(PIO1_IRQ_0, true) ;
 
-    // Channel One (gets data from RX PIO machine)
+    // Channel One (gets the header from RX PIO machine, then hands over
+    // to channel Five for the rest of the frame)
     dma_channel_config c1 = dma_channel_get_default_config(dma_chan_1);
     channel_config_set_transfer_data_size(&c1, DMA_SIZE_8);
     channel_config_set_read_increment(&c1, false);
     channel_config_set_write_increment(&c1, true);
     channel_config_set_dreq(&c1, DREQ_PIO1_RX0) ;
+    channel_config_set_chain_to(&c1, dma_chan_5);
 
     dma_channel_configure(
         dma_chan_1,                 // Channel to be configured
         &c1,                        // The configuration we just created
-        rx_packet_stuffed_pointer,  // write address (receive buffer)
+        rx_packet_stuffed[rx_dma],  // write address (receive buffer)
         &pio_1->rxf[can_rx_sm],     // read address (receive PIO RX FIFO)
-        sizeof(rx_packet_stuffed),  // Number of transfers (aborts early!!)
+        RX_HEADER_BYTES,            // Number of transfers (the ID)
         false                       // Don't start immediately.
     );
-  
-    // Tell DMA to rasie IRQ line 0 when channel 1 finished a block
-    dma_channel_set_irq0_enabled(dma_chan_1, true);
+
+    // Tell DMA to raise IRQ line 1 when channel 1 has the header
+    dma_channel_set_irq1_enabled(dma_chan_1, true);
+
+    // Configure the processor to run header_handler() when DMA IRQ 1 is asserted
+    irq_set_exclusive_handler(DMA_IRQ_1, header_handler);
+    irq_set_enabled(DMA_IRQ_1, true);
+
+    // Tell DMA to rasie IRQ line 0 when channel 5 finished a block
+    dma_channel_set_irq0_enabled(dma_chan_5, true);
 
     // Configure the processor to run dma_handler() when DMA IRQ 0 is asserted
     irq_set_exclusive_handler(DMA_IRQ_0, dma_handler);
@@ -586,9 +918,34 @@ void CAN::setupCANRX(irq_handler_t handler) {
     // Start the RX PIO machine
     pio_sm_set_enabled(pio_1, can_rx_sm, true) ;
 
-    // Start the RX DMA channel
-    dma_start_channel_mask((1u << dma_chan_1)) ;
+    // Set up channel Five and start the RX DMA channels
+    armReceiver() ;
+
+}
+
+// Points the RX DMA channels at the current ring slot and starts them:
+// header first, the rest of the frame straight after it
+void CAN::armReceiver() {
+    unsigned char * slot = rx_packet_stuffed[rx_dma] ;
 
+    // Channel Five (gets the rest of the frame from RX PIO machine)
+    dma_channel_config c5 = dma_channel_get_default_config(dma_chan_5);
+    channel_config_set_transfer_data_size(&c5, DMA_SIZE_8);
+    channel_config_set_read_increment(&c5, false);
+    channel_config_set_write_increment(&c5, true);
+    channel_config_set_dreq(&c5, DREQ_PIO1_RX0) ;
+
+    dma_channel_configure(
+        dma_chan_5,                 // Channel to be configured
+        &c5,                        // The configuration we just created
+        slot + RX_HEADER_BYTES,     // write address (after the header)
+        &pio_1->rxf[can_rx_sm],     // read address (receive PIO RX FIFO)
+        MAX_STUFFED_PACKET_LEN - RX_HEADER_BYTES, // Number of transfers (aborts early!!)
+        false                       // Started by channel One
+    );
+
+    // Reset the header channel write address, and start the channel
+    dma_channel_set_write_addr(dma_chan_1, slot, true) ;
 }
 
 // Call in the tx_handler ISR to reset the transmitter
@@ -599,25 +956,48 @@ inline void CAN::resetTransmitter() {
     pio_sm_drain_tx_fifo(pio_0, can_tx_sm) ;
     // Unstall the PIO state machine
     pio_interrupt_clear(pio_0, 0) ;
-    // Reset the DMA channel read address, don't start channel yet
-    dma_channel_set_read_addr(dma_chan_0, tx_packet_stuffed_pointer, false) ;
-    // WHY IS THIS NECESSARY? Did not need this until I added the transcievers
-    sleep_us(10) ;
+    // The TX_GUARD_US quiet time the transcievers need is timed by the
+    // guard alarm (see tx_handler), not here
 }
 
 // Call in the rx_handler ISR to reset the receiver
 inline void CAN::resetReceiver() {
-    // Full message received, abort DMA channel 2
-    // disable the channel on IRQ0
-    dma_channel_set_irq0_enabled(dma_chan_1, false);
-    // abort the channel
+    // Full message received, abort DMA channels 1 and 5
+    // disable the channels on their IRQs
+    dma_channel_set_irq1_enabled(dma_chan_1, false);
+    dma_channel_set_irq0_enabled(dma_chan_5, false);
+    // abort the channels
     dma_channel_abort(dma_chan_1);
-    // clear the spurious IRQ (if there was one)
-    dma_channel_acknowledge_irq0(dma_chan_1);
-    // re-enable the channel on IRQ0
-    dma_channel_set_irq0_enabled(dma_chan_1, true);
-    // Reset the DMA channel write address, and start the channel
-    dma_channel_set_write_addr(dma_chan_1, rx_packet_stuffed_pointer, true) ;
+    dma_channel_abort(dma_chan_5);
+    // clear the spurious IRQs (if there were any), including a header
+    // that has not been filtered yet
+    dma_channel_acknowledge_irq1(dma_chan_1);
+    dma_channel_acknowledge_irq0(dma_chan_5);
+    irq_clear(DMA_IRQ_1);
+    // re-enable the channels on their IRQs
+    dma_channel_set_irq1_enabled(dma_chan_1, true);
+    dma_channel_set_irq0_enabled(dma_chan_5, true);
+    if (rx_filtered) {
+        // Not for us: reuse the slot, the worker never hears of it. Counted
+        // apart from number_missed, which the worker updates.
+        rx_filtered = false ;
+        number_filtered += 1 ;
+    } else {
+        // Pass the frame to the RX worker and move on to the next slot. If
+        // that one still holds the worker's oldest frame, the ring is
+        // full: drop this frame and reuse its slot.
+        int next = (rx_dma + 1) % RX_RING_SLOTS ;
+        if (next != rx_tail) {
+            rx_slot_us[rx_dma] = time_us_64() ;
+            // Frame in memory before the worker can see it
+            __dmb() ;
+            rx_dma = next ;
+        } else {
+            number_overrun += 1 ;
+        }
+    }
+    // Restart the DMA channels on the slot
+    armReceiver() ;
 }
 
 // At end of receive ISR, clear interrupt to accept new packets
@@ -10,6 +10,7 @@
 #include "hardware/dma.h"
 #include "hardware/irq.h"
 #include "can.pio.h"
+#include "can_codec.h"
 
 // ----------------------------------------------------------------------
 // Define Pins
@@ -23,21 +24,134 @@
 // CAN parameters
 // ----------------------------------------------------------------------
 
-// Size of TX buffer
+// Payload capacity in bytes, which sizes every frame buffer of the
+// driver. Set it per node at build time (the length field allows 255);
+// nodes only receive frames that fit.
+#ifndef MAX_PAYLOAD_SIZE
 #define MAX_PAYLOAD_SIZE        16
-#define MAX_PACKET_LEN          MAX_PAYLOAD_SIZE + 8
-#define MAX_STUFFED_PACKET_LEN  MAX_PACKET_LEN + ( MAX_PACKET_LEN >> 1 )
+#endif
+static_assert((MAX_PAYLOAD_SIZE >= 1) && (MAX_PAYLOAD_SIZE <= 255),
+              "MAX_PAYLOAD_SIZE must fit the one-byte length field") ;
+#define MAX_PACKET_LEN          ( MAX_PAYLOAD_SIZE + 8 )
+#define MAX_STUFFED_PACKET_LEN  ( MAX_PACKET_LEN + ( MAX_PACKET_LEN >> 1 ) )
+
+// Quiet time after each frame before the next one is handed to the TX
+// machine (microseconds)
+#define TX_GUARD_US             10
+
+// Default retransmission policy: how many times a frame may lose
+// arbitration and go again, and how long it may wait for the bus
+// (microseconds, from when it is handed to the TX machine). Change at run
+// time with set_tx_retry_limit/set_tx_timeout.
+#define TX_RETRY_LIMIT          16
+#define TX_TIMEOUT_US           10000
+
+// Number of encoded frames that can wait for the bus. Each has its own
+// stuffed buffer, so with two or more the next frame is encoded while the
+// DMA channel is still reading the current one.
+#ifndef TX_QUEUE_SLOTS
+#define TX_QUEUE_SLOTS          4
+#endif
+
+// Raw receive buffers, used as a ring: the RX DMA channel fills one while
+// the others hold frames waiting for the RX worker (processReceived), so
+// up to RX_RING_SLOTS-1 frames can arrive back to back before it runs
+#ifndef RX_RING_SLOTS
+#define RX_RING_SLOTS           8
+#endif
+
+static_assert(RX_RING_SLOTS >= 2, "the RX ring needs a slot for the DMA channel and one for the worker") ;
+
+// Decoded frames waiting for rx_pop (one less fits)
+#ifndef RX_QUEUE_FRAMES
+#define RX_QUEUE_FRAMES         16
+#endif
+
+// Stuffed bytes that always hold the 16 ID bits (up to 3 stuff bits among
+// them). The RX DMA channel stops after these so the ID can be filtered
+// while the rest of the frame is still on the bus.
+#define RX_HEADER_BYTES         3
 
 // ----------------------------------------------------------------------
-// Define clock and checksum parameters
+// Define clock parameters (checksum parameters are in can_codec.h)
 // ----------------------------------------------------------------------
 
-// Clock settings
+// Clock settings: the default PIO divider suits 1 Mbit/s at 160 MHz
+// (160/5/32=1). set_bitrate works the divider out for other rates, and
+// sys_clock_khz picks a system clock that makes it exact.
 #define OVERCLOCK_RATE 160000
 #define CLKDIV         5
-// Checksum polynomial and initial value
-#define CRC16_POLY     0x8005
-#define CRC_INIT       0xFFFF
+#define CAN_BITRATE    1000000
+#define MIN_SYS_CLOCK  48000          // lowest system clock sys_clock_khz tries (kHz)
+
+// Every PIO program takes 32 cycles per bit
+#define PIO_CYCLES_PER_BIT  32
+
+// ----------------------------------------------------------------------
+// Payload view
+// ----------------------------------------------------------------------
+
+// Bytes of a frame payload, in the order they go out on the bus
+struct can_payload {
+    unsigned char * data ;
+    unsigned int size ;     // in bytes
+} ;
+
+// ----------------------------------------------------------------------
+// TX queue
+// ----------------------------------------------------------------------
+
+// Queued frames go out lowest arbitration first (as the bus would pick
+// them), in submission order for equal arbitration
+enum tx_slot_state {
+    TX_SLOT_FREE,       // available to sendPacket
+    TX_SLOT_QUEUED,     // encoded, waiting for its turn
+    TX_SLOT_ACTIVE      // handed to the TX DMA channel and state machine
+} ;
+
+// A frame for send_async, owned by the caller
+struct can_frame {
+    unsigned short arbitration ;
+    unsigned char len ;                         // payload length in bytes
+    unsigned char data[MAX_PAYLOAD_SIZE] ;
+} ;
+
+// Outcome of a frame queued with send_async
+enum can_tx_status {
+    TX_DONE,            // went out on the bus
+    TX_ARB_LOST,        // lost arbitration more often than the retry limit allows
+    TX_TIMEOUT          // still waiting for the bus at the deadline
+} ;
+
+// What happened to a frame, with timestamps (time_us_64) that split its
+// latency into queueing (start_us - queued_us), waiting for an idle bus
+// and losing arbitration (sof_us - start_us) and wire time (end_us -
+// sof_us)
+struct can_tx_record {
+    can_tx_status status ;
+    unsigned short arbitration ;
+    int lost ;                  // arbitrations lost on the way
+    uint64_t queued_us ;        // taken into the TX queue
+    uint64_t start_us ;         // handed to the TX machine (last time, if preempted)
+    uint64_t sof_us ;           // start of frame of the last attempt, 0 if none
+    uint64_t end_us ;           // end of frame, or when it was given up on
+} ;
+
+// Called from tx_handler (interrupt context, so keep it short). The
+// record is only valid during the call.
+typedef void (*can_tx_callback)(const can_tx_record * record, void * context) ;
+
+// Called from processReceived (the RX worker) with the payload of each
+// frame accepted. The data is only valid during the call.
+typedef void (*can_rx_callback)(const unsigned char * data, int len, void * context) ;
+
+// A received frame, as rx_pop hands it out
+struct can_rx_frame {
+    unsigned short arbitration ;
+    unsigned char len ;                         // payload length in bytes
+    unsigned char data[MAX_PAYLOAD_SIZE] ;
+    uint64_t end_us ;                           // end of frame (time_us_64)
+} ;
 
 // ----------------------------------------------------------------------
 // CAN Bus
@@ -51,31 +165,106 @@ class CAN {
   public:
     CAN( unsigned short my_arbitration, unsigned short arbitration, unsigned short network_broadcast );
 
+    // Both of these move the ID in the acceptance filter. The old ID is
+    // taken out unless it is also the other one of the two: the setters
+    // own those bits, so subscribe again (rx_filter_add_*) to an ID that
+    // should stay in.
     void set_my_arbitration( unsigned short my_arbitration ) {
+      if (this->my_arbitration != network_broadcast) {
+        can_filter_remove_id(&rx_filter, this->my_arbitration);
+      }
       this->my_arbitration = my_arbitration;
+      can_filter_add_id(&rx_filter, my_arbitration);
     }
     void set_arbitration( unsigned short arbitration ) {
       this->arbitration = arbitration;
+      header_cache_valid = false;
     }
     void set_network_broadcast( unsigned short network_broadcast ) {
+      if (this->network_broadcast != my_arbitration) {
+        can_filter_remove_id(&rx_filter, this->network_broadcast);
+      }
       this->network_broadcast = network_broadcast;
+      can_filter_add_id(&rx_filter, network_broadcast);
     }
-    void set_payload( unsigned short * new_payload, unsigned char len ) {
-      payload_len = len;
-      for (int i = 0; i < len; i++) {
-          payload[i] = new_payload[i];
+
+    // Loans out the payload buffer (MAX_PAYLOAD_SIZE bytes) to be written
+    // in place, then sets how many bytes of it the next frame carries.
+    // Safe to use while the previous frame is on the bus.
+    can_payload acquire_payload() {
+      can_payload view = { payload, MAX_PAYLOAD_SIZE };
+      return view;
+    }
+    void commit_payload( unsigned int len ) {
+      payload_len = (len > MAX_PAYLOAD_SIZE) ? MAX_PAYLOAD_SIZE : len;
+    }
+
+    // Copies len 16-bit words into the payload, each one high byte first
+    void set_payload( const unsigned short * new_payload, unsigned char len ) {
+      can_payload view = acquire_payload();
+      unsigned int n = ((2u * len) > view.size) ? (view.size >> 1) : len;
+      for (unsigned int i = 0; i < n; i++) {
+          view.data[2*i]   = (unsigned char)(new_payload[i] >> 8);
+          view.data[2*i+1] = (unsigned char)(new_payload[i]);
       }
+      commit_payload(2 * n);
     }
     unsigned short get_my_rbitration() { return my_arbitration; }
     unsigned short get_arbitration() { return arbitration; }
     unsigned short get_network_broadcast() { return network_broadcast; }
-    unsigned short get_payload() { return payload[MAX_PAYLOAD_SIZE]; }
+    void set_rx_callback( can_rx_callback rx_callback, void * rx_context ) {
+      this->rx_callback = rx_callback;
+      this->rx_context = rx_context;
+    }
+    can_payload get_payload() {
+      can_payload view = { payload, payload_len };
+      return view;
+    }
+
+    // Acceptance filter: received frames are kept if their ID is in it,
+    // at the cost of one lookup whatever it holds. Starts out with
+    // my_arbitration and network_broadcast. Change it from the core that
+    // runs processReceived.
+    void rx_filter_clear() { can_filter_clear(&rx_filter); }
+    void rx_filter_add_id( unsigned short id ) { can_filter_add_id(&rx_filter, id); }
+    void rx_filter_add_mask( unsigned short id, unsigned short mask ) {
+      can_filter_add_mask(&rx_filter, id, mask);
+    }
+    void rx_filter_add_range( unsigned short first, unsigned short last ) {
+      can_filter_add_range(&rx_filter, first, last);
+    }
+    void rx_filter_remove_id( unsigned short id ) { can_filter_remove_id(&rx_filter, id); }
+
+
+    // Bus bitrate (bit/s) for all three state machines, from the current
+    // system clock. Takes effect at once if they are running; call with
+    // nothing queued or on the bus. The divider is fractional unless the
+    // system clock is a multiple of 32 x bitrate, which costs up to one
+    // system clock of jitter per bit. Returns false if the rate is out of
+    // reach of the divider.
+    bool set_bitrate( unsigned int bitrate );
+    unsigned int get_bitrate() { return bitrate; }
 
+    // Highest system clock (kHz, OVERCLOCK_RATE at most) the PLL can make
+    // that gives an exact divider for bitrate, or 0 if there is none
+    static unsigned int sys_clock_khz( unsigned int bitrate );
 
     // User interrupt service routine
     void tx_handler();
     void rx_handler();
 
+    // RX worker: decodes the frames rx_handler captured, oldest first.
+    // Call from a thread (or the other core) whenever rx_available().
+    bool rx_available() { return rx_tail != rx_dma; }
+    void processReceived();
+
+    // Frames accepted while no rx_callback is set are queued for a single
+    // consumer, on either core. In a protothread, wait for them with
+    // PT_YIELD_UNTIL(pt, rx_frame_ready()). rx_pop returns false if the
+    // queue is empty. Frames that find it full count in number_dropped.
+    bool rx_frame_ready() { return rx_queue_tail != rx_queue_head; }
+    bool rx_pop( can_rx_frame * frame );
+
     void set_number_sent( volatile int  number_sent ) {
       this->number_sent = number_sent;
     }
@@ -85,32 +274,84 @@ class CAN {
     void set_number_missed( volatile int  number_missed ) {
       this->number_missed = number_missed;
     }
-    void set_unsafe_to_tx( volatile int  unsafe_to_tx ) {
-      this->unsafe_to_tx = unsafe_to_tx;
-    }
     int get_number_sent() { return number_sent; }
     int get_number_received() { return number_received; }
     int get_number_missed() { return number_missed; }
-    int get_unsafe_to_tx() { return unsafe_to_tx; }
+    // Nonzero while a frame is queued or on the bus, as before the TX
+    // queue (use get_tx_space to send without waiting for it to drain)
+    int get_unsafe_to_tx() { return (tx_active >= 0) || (tx_free < TX_QUEUE_SLOTS); }
+    void set_number_lost( volatile int  number_lost ) {
+      this->number_lost = number_lost;
+    }
+    void set_number_failed( volatile int  number_failed ) {
+      this->number_failed = number_failed;
+    }
+    int get_number_lost() { return number_lost; }
+    int get_number_failed() { return number_failed; }
+    void set_number_overrun( volatile int  number_overrun ) {
+      this->number_overrun = number_overrun;
+    }
+    int get_number_overrun() { return number_overrun; }
+    void set_number_filtered( volatile int  number_filtered ) {
+      this->number_filtered = number_filtered;
+    }
+    int get_number_filtered() { return number_filtered; }
+    void set_number_dropped( volatile int  number_dropped ) {
+      this->number_dropped = number_dropped;
+    }
+    int get_number_dropped() { return number_dropped; }
+    // Free TX queue slots (sendPacket blocks when there are none)
+    int get_tx_space() { return tx_free; }
+    // Completion record of the last frame done with, sent or not
+    can_tx_record get_last_tx() { return tx_last; }
+
+    // Retransmission policy for frames started from now on. A negative
+    // limit retries forever, a zero timeout waits forever.
+    void set_tx_retry_limit( int tx_retry_limit ) {
+      this->tx_retry_limit = tx_retry_limit;
+    }
+    void set_tx_timeout( unsigned int tx_timeout_us ) {
+      this->tx_timeout_us = tx_timeout_us;
+    }
 
 
-    // Computes the checksum
+    // Computes the checksum (one byte, table-driven)
     unsigned short culCalcCRC(char crcData, unsigned short crcReg);
 
     // Packet transmission
-    unsigned short getBitShort(unsigned short * shorty, unsigned char bitnum);
-    void modifyBitShort(unsigned short * shorty, unsigned char bitnum, unsigned short value);
     void bitStuff(unsigned short * unstuffed, unsigned short * stuffed);
+    void cacheHeader(unsigned short id);
+    void encodePacket(can_encoder * enc, unsigned short id, unsigned short header,
+                      const unsigned char * data, int len, unsigned short * out);
     void sendPacket();
+    bool send_async(const can_frame * frame, can_tx_callback callback, void * context);
+    int sendBurst(const can_frame * frames, int n);
+    void queuePacket(unsigned short id, const unsigned char * data, int len,
+                     can_tx_callback callback, void * context);
+    void encodeSlot(int slot, unsigned short id, const unsigned char * data, int len);
+    void queueSlot(int slot, can_tx_callback callback, void * context);
+    void kickTransmit();
+    void startNext();
+    bool armAlarm(unsigned int us);
+    void alarmElapsed();
+    void guardElapsed();
+    void deadlineElapsed();
+    void busIdle();
+    void arbitrationLost();
+    void failActive(can_tx_status status);
+    void retireActive(can_tx_status status);
+    void startTransmit(int slot);
+    bool preemptTransmit();
 
     // Packet reception
-    unsigned char getBitChar(unsigned char * byte, unsigned char bitnum);
-    void modifyBitChar(unsigned char * byte, unsigned char bitnum, unsigned char value);
-    void unBitStuff(unsigned char * stuffed, unsigned char * unstuffed);
-    unsigned char attemptPacketReceive();
+    int unBitStuff(unsigned char * stuffed, unsigned char * unstuffed);
+    unsigned char attemptPacketReceive(const unsigned char * stuffed);
+    void queueReceived(uint64_t end_us);
 
     // Driver interrupt service routine (ISR)
     static void dma_handler(); // overrun on the RX DMA channel, then being reset
+    static void header_handler(); // ID of an incoming frame in, filter it
+    static void bus_handler(); // bus found idle, or TX machine lost arbitration
 
     // Setup CAN bus 
     void setupIdleCheck();
@@ -119,20 +360,98 @@ class CAN {
 
     // API helper functions
     static inline void resetTransmitter();
-    static inline void resetReceiver();
+    inline void resetReceiver();
+    void armReceiver();
+    void filterHeader();
     static inline void acceptNewPacket();
 
     protected:
       unsigned short my_arbitration, arbitration, network_broadcast;
+      can_filter rx_filter;         // IDs of received frames to keep
       unsigned int tx_idle_time;    // time to wait (in bit times) for bus to be idle before TX
+      unsigned int bitrate;         // bus bitrate (bit/s)
+      unsigned int pio_clkdiv;      // PIO clock divider for it (16.8 fixed point)
       unsigned char reserve_byte;   // reserve byte
-      unsigned char payload_len;    // payload length in bytes (even)
-      unsigned short payload[MAX_PAYLOAD_SIZE] = {0x1335, 0x5678, 0x9012, 0x3456, 0x7890};
+      unsigned char payload_len;    // payload length in bytes
+      unsigned char payload[MAX_PAYLOAD_SIZE];
+
+      // Frame buffers, sized by MAX_PAYLOAD_SIZE: a stuffed frame per TX
+      // queue slot (encoded straight from the payload) and its length in
+      // words, raw received frames, and the one decoded last
+      unsigned short tx_packet_stuffed[TX_QUEUE_SLOTS][MAX_STUFFED_PACKET_LEN>>1];
+      unsigned short tx_packet_words[TX_QUEUE_SLOTS];
+      unsigned char rx_packet_stuffed[RX_RING_SLOTS][MAX_STUFFED_PACKET_LEN];
+      unsigned char rx_packet_unstuffed[MAX_PACKET_LEN];
+
+      // RX ring: the slot the DMA channel is filling (written by
+      // rx_handler) and the oldest one holding a frame for the RX worker
+      // (written by processReceived). Empty when they are equal.
+      volatile int rx_dma;
+      volatile int rx_tail;
+      uint64_t rx_slot_us[RX_RING_SLOTS];   // end of the frame in each slot
+      // The frame coming in failed the acceptance filter on its ID, and is
+      // being discarded
+      volatile bool rx_filtered;
+
+      // Decoded frames: the RX worker fills the slot at rx_queue_head, the
+      // consumer empties the one at rx_queue_tail. Each index has a single
+      // writer, so neither side takes a lock.
+      can_rx_frame rx_queue[RX_QUEUE_FRAMES];
+      volatile int rx_queue_head;
+      volatile int rx_queue_tail;
+
+      // Encoder state after arbitration and reserve byte, which only
+      // change with the destination (see cacheHeader)
+      can_encoder header_cache;
+      unsigned short header_cache_words[2];
+      unsigned short header_cache_id;
+      bool header_cache_valid;
 
       volatile int number_sent;     // # of sent messages
       volatile int number_received; // # of received messages
-      volatile int number_missed;   // # of rejected packets
-      volatile int unsafe_to_tx;    // flag for indicating that it is unsafe to transmit
+      volatile int number_missed;   // # of packets the RX worker rejected
+      volatile int number_lost;     // # of lost arbitrations
+      volatile int number_failed;   // # of frames given up on (retry limit or timeout)
+      volatile int number_overrun;  // # of frames dropped with the RX ring full
+      volatile int number_filtered; // # of frames dropped on their ID by the RX interrupt
+      volatile int number_dropped;  // # of decoded frames dropped with the RX queue full
+
+      // TX queue: state, arbitration, submission order and completion
+      // callback of each slot, the slot being sent (or -1) and the number
+      // of free slots
+      volatile unsigned char tx_slot_state[TX_QUEUE_SLOTS];
+      unsigned short tx_slot_id[TX_QUEUE_SLOTS];
+      unsigned int tx_slot_seq[TX_QUEUE_SLOTS];
+      can_tx_callback tx_slot_callback[TX_QUEUE_SLOTS];
+      void * tx_slot_context[TX_QUEUE_SLOTS];
+      uint64_t tx_slot_queued_us[TX_QUEUE_SLOTS];
+      unsigned int tx_seq;
+      volatile int tx_active;
+      volatile int tx_free;
+
+      // Retry limit and timeout, and how often the active frame has lost
+      // arbitration so far
+      int tx_retry_limit;
+      unsigned int tx_timeout_us;
+      int tx_lost;
+
+      // When the active frame was handed to the TX machine and when its
+      // start of frame went out, and the record of the last frame retired
+      uint64_t tx_start_us;
+      volatile uint64_t tx_sof_us;
+      can_tx_record tx_last;
+
+      // Hardware alarm timing either the post-frame guard or the deadline
+      // of the active frame (never both), when it is due, and which of the
+      // two is running
+      int tx_alarm;
+      uint64_t tx_alarm_due;
+      volatile bool tx_guard;
+      volatile bool tx_deadline;
+
+      // Where accepted frames go, besides rx_packet_unstuffed
+      can_rx_callback rx_callback;
+      void * rx_context;
 };
 
 #endif  // CAN_H
\ No newline at end of file
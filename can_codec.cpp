@@ -0,0 +1,332 @@
+#include "can_codec.h"
+#include <string.h>
+
+
+// ----------------------------------------------------------------------
+// CRC16 lookup tables (generated at compile time)
+// ----------------------------------------------------------------------
+
+// Same bit-serial update as the original culCalcCRC, run once per table entry
+static constexpr unsigned short crc16_bitwise(unsigned char data, unsigned short crc) {
+    for (int i = 0; i < 8; i++) {
+        if (((crc & 0x8000) >> 8) ^ (data & 0x80)) {
+            crc = (unsigned short)((crc << 1) ^ CRC16_POLY) ;
+        } else {
+            crc = (unsigned short)(crc << 1) ;
+        }
+        data = (unsigned char)(data << 1) ;
+    }
+    return crc ;
+}
+
+static constexpr crc16_tables make_crc16_tables() {
+    crc16_tables tables = {} ;
+    for (int i = 0; i < 256; i++) {
+        // Register i<<8 fed a zero byte is the same as register 0 fed byte i
+        tables.t[0][i] = crc16_bitwise(0, (unsigned short)(i << 8)) ;
+    }
+    for (int k = 1; k < 4; k++) {
+        for (int i = 0; i < 256; i++) {
+            unsigned short prev = tables.t[k-1][i] ;
+            tables.t[k][i] = (unsigned short)((prev << 8) ^ tables.t[0][(prev >> 8) & 0xFF]) ;
+        }
+    }
+    return tables ;
+}
+
+// Constant-initialized, so the startup code copies it into RAM
+crc16_tables crc16 = make_crc16_tables() ;
+
+// ----------------------------------------------------------------------
+// Buffer checksums
+// ----------------------------------------------------------------------
+
+unsigned short crc16_bytes(unsigned short crc, const unsigned char * data, int len) {
+    // Four bytes per step
+    while (len >= 4) {
+        crc = crc16_word(crc, (((unsigned int)data[0]) << 24) |
+                              (((unsigned int)data[1]) << 16) |
+                              (((unsigned int)data[2]) << 8)  |
+                              ((unsigned int)data[3])) ;
+        data += 4 ;
+        len  -= 4 ;
+    }
+    // Leftover bytes
+    while (len > 0) {
+        crc = crc16_byte(crc, *data++) ;
+        len -= 1 ;
+    }
+    return crc ;
+}
+
+unsigned short crc16_shorts(unsigned short crc, const unsigned short * data, int len) {
+    // Two words per step
+    while (len >= 2) {
+        crc = crc16_word(crc, (((unsigned int)data[0]) << 16) | data[1]) ;
+        data += 2 ;
+        len  -= 2 ;
+    }
+    if (len > 0) {
+        crc = crc16_short(crc, data[0]) ;
+    }
+    return crc ;
+}
+
+// ----------------------------------------------------------------------
+// Bit stuffing table (generated at compile time)
+// ----------------------------------------------------------------------
+
+// Runs the bit-at-a-time stuffing rule of the original bitStuff over
+// one byte, starting from the given run-length state
+static constexpr unsigned short stuff_entry(int state, int data) {
+    int old_val = (state == 0) ? 2 : ((state - 1) >> 2) ;
+    int run_len = (state == 0) ? 1 : ((state - 1) & 0x3) + 1 ;
+    unsigned int out = 0 ;
+    int added = 0 ;
+    for (int i = 7; i >= 0; i--) {
+        int new_val = (data >> i) & 1 ;
+        run_len = (new_val == old_val) ? (run_len + 1) : 1 ;
+        old_val = new_val ;
+        out = (out << 1) | new_val ;
+        if (run_len == 5) {
+            out = (out << 1) | !new_val ;
+            added += 1 ;
+            run_len = 1 ;
+            old_val = !new_val ;
+        }
+    }
+    int new_state = 1 + (old_val << 2) + (run_len - 1) ;
+    return (unsigned short)((new_state << 12) | (added << 10) | out) ;
+}
+
+static constexpr stuff_tables make_stuff_tables() {
+    stuff_tables tables = {} ;
+    for (int state = 0; state < STUFF_STATES; state++) {
+        for (int data = 0; data < 256; data++) {
+            tables.t[state][data] = stuff_entry(state, data) ;
+        }
+    }
+    return tables ;
+}
+
+stuff_tables can_stuff = make_stuff_tables() ;
+
+// ----------------------------------------------------------------------
+// Destuffing table (generated at compile time)
+// ----------------------------------------------------------------------
+
+// Runs the bit-at-a-time rule of the original unBitStuff over one byte,
+// additionally checking that every skipped stuff bit is a complement
+static constexpr unsigned short destuff_entry(int state, int data) {
+    int old_val = 2 ;
+    int run_len = 0 ;
+    int skip    = 0 ;
+    if ((state >= 1) && (state <= 8)) {
+        old_val = (state - 1) >> 2 ;
+        run_len = ((state - 1) & 0x3) + 1 ;
+    } else if (state > 8) {
+        old_val = state - 9 ;
+        skip    = 1 ;
+    }
+    unsigned int out = 0 ;
+    int count = 0 ;
+    for (int i = 7; i >= 0; i--) {
+        int new_val = (data >> i) & 1 ;
+        if (skip) {
+            // Stuff bit: must differ from the run it ends, then starts a new run
+            if (new_val == old_val) {
+                return (unsigned short)((DESTUFF_ERROR << 12) | (count << 8) | out) ;
+            }
+            skip    = 0 ;
+            old_val = new_val ;
+            run_len = 1 ;
+            continue ;
+        }
+        run_len = (new_val == old_val) ? (run_len + 1) : 1 ;
+        old_val = new_val ;
+        out = (out << 1) | new_val ;
+        count += 1 ;
+        if (run_len == 5) {
+            skip = 1 ;
+        }
+    }
+    int new_state = skip ? (9 + old_val) : (1 + (old_val << 2) + (run_len - 1)) ;
+    return (unsigned short)((new_state << 12) | (count << 8) | out) ;
+}
+
+static constexpr destuff_tables make_destuff_tables() {
+    destuff_tables tables = {} ;
+    for (int state = 0; state < DESTUFF_STATES; state++) {
+        for (int data = 0; data < 256; data++) {
+            tables.t[state][data] = destuff_entry(state, data) ;
+        }
+    }
+    return tables ;
+}
+
+destuff_tables can_destuff = make_destuff_tables() ;
+
+// ----------------------------------------------------------------------
+// Bit stuffing
+// ----------------------------------------------------------------------
+
+int can_bit_stuff(const unsigned short * words, int nwords, unsigned short * stuffed) {
+    can_stuffer st ;
+    can_stuff_begin(&st, stuffed) ;
+    for (int i = 0; i < nwords; i++) {
+        can_stuff_byte(&st, (unsigned char)(words[i] >> 8)) ;
+        can_stuff_byte(&st, (unsigned char)(words[i])) ;
+    }
+    return can_stuff_end(&st, stuffed) ;
+}
+
+// ----------------------------------------------------------------------
+// Destuffing
+// ----------------------------------------------------------------------
+
+int can_bit_unstuff(const unsigned char * stuffed, int stuffed_len,
+                    unsigned char * unstuffed, int unstuffed_len, int * violation) {
+    can_destuffer ds ;
+    can_destuff_begin(&ds) ;
+    int count = 0 ;
+    *violation = 0 ;
+
+    // Until we find the end of frame . . .
+    for (int i = 0; (i < stuffed_len) && (stuffed[i] != 0xFF); i++) {
+        int ok = can_destuff_byte(&ds, stuffed[i]) ;
+        // Data that came before a violation is still good
+        while ((count < unstuffed_len) && can_destuff_pop(&ds, &unstuffed[count])) {
+            count += 1 ;
+        }
+        if (!ok) {
+            *violation = 1 ;
+            return count ;
+        }
+        if (count == unstuffed_len) {
+            return count ;
+        }
+    }
+
+    // Zero-pad whatever is left of the last byte
+    if (ds.bits > 0) {
+        unstuffed[count] = (unsigned char)(ds.acc << (8 - ds.bits)) ;
+    }
+    return count ;
+}
+
+// ----------------------------------------------------------------------
+// Acceptance filter
+// ----------------------------------------------------------------------
+
+void can_filter_clear(can_filter * filter) {
+    memset(filter, 0, sizeof(*filter)) ;
+}
+
+void can_filter_add_id(can_filter * filter, unsigned short id) {
+    filter->ids[id >> 5] |= 1u << (id & 31) ;
+    filter->hi[id >> 13] |= 1u << ((id >> 8) & 31) ;
+}
+
+void can_filter_add_mask(can_filter * filter, unsigned short id, unsigned short mask) {
+    // Walk every combination of the don't-care bits, down to none of them
+    unsigned short base = id & mask ;
+    unsigned short dont_care = ~mask ;
+    unsigned short bits = dont_care ;
+    while (1) {
+        can_filter_add_id(filter, base | bits) ;
+        if (bits == 0) {
+            break ;
+        }
+        bits = (bits - 1) & dont_care ;
+    }
+}
+
+void can_filter_add_range(can_filter * filter, unsigned short first, unsigned short last) {
+    for (unsigned int id = first; id <= last; id++) {
+        can_filter_add_id(filter, (unsigned short)id) ;
+    }
+}
+
+void can_filter_remove_id(can_filter * filter, unsigned short id) {
+    filter->ids[id >> 5] &= ~(1u << (id & 31)) ;
+    // The high byte stays in hi while any of its 256 IDs is accepted
+    const unsigned int * row = &filter->ids[(id >> 8) << 3] ;
+    unsigned int any = 0 ;
+    for (int i = 0; i < 8; i++) {
+        any |= row[i] ;
+    }
+    if (!any) {
+        filter->hi[id >> 13] &= ~(1u << ((id >> 8) & 31)) ;
+    }
+}
+
+// ----------------------------------------------------------------------
+// Single-pass frame decoder
+// ----------------------------------------------------------------------
+
+can_rx_status can_decode_frame(const unsigned char * stuffed, int stuffed_len,
+                               unsigned char * unstuffed, int max_payload,
+                               const can_filter * filter, int check_crc) {
+    can_destuffer ds ;
+    can_destuff_begin(&ds) ;
+
+    unsigned short checksum = CRC_INIT ;
+    int count     = 0 ;
+    int crc_start = FRAME_HEADER_LEN ;     // where the checksum begins (once known)
+    unsigned char data ;
+
+    for (int i = 0; (i < stuffed_len) && (stuffed[i] != 0xFF); i++) {
+        int ok = can_destuff_byte(&ds, stuffed[i]) ;
+        while (can_destuff_pop(&ds, &data)) {
+            unstuffed[count] = data ;
+            if (count < FRAME_HEADER_LEN) {
+                // Header: filter on the ID as soon as each byte is out
+                if ((count == 0) && !can_filter_hi(filter, data)) {
+                    return RX_NOT_FOR_US ;
+                }
+                if ((count == 1) && !can_filter_match(filter, (unsigned short)((unstuffed[0] << 8) | data))) {
+                    return RX_NOT_FOR_US ;
+                }
+                if (count == 3) {
+                    if (data > max_payload) {
+                        return RX_BAD_LENGTH ;
+                    }
+                    crc_start = FRAME_HEADER_LEN + data ;
+                }
+            }
+            if (count < crc_start) {
+                checksum = crc16_byte(checksum, data) ;
+            } else if (count == crc_start + 1) {
+                // Checksum complete
+                if (!check_crc) {
+                    return RX_OK ;
+                }
+                return ((unstuffed[crc_start] == ((checksum >> 8) & 0xFF)) &&
+                        (data == (checksum & 0xFF))) ? RX_OK : RX_BAD_CRC ;
+            }
+            count += 1 ;
+        }
+        if (!ok) {
+            return RX_STUFF_ERROR ;
+        }
+    }
+    return RX_STUFF_ERROR ;
+}
+
+// ----------------------------------------------------------------------
+// DMA sniffer model
+// ----------------------------------------------------------------------
+
+void crc16_sniff_transfer(crc16_sniffer * sniffer, unsigned int value, int size) {
+    unsigned short crc = (unsigned short)sniffer->data ;
+    for (int k = 0; k < size; k++) {
+        int shift = sniffer->bswap ? (8 * k) : (8 * (size - 1 - k)) ;
+        unsigned char data = (unsigned char)(value >> shift) ;
+        crc ^= (unsigned short)(data << 8) ;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc & 0x8000) ? (unsigned short)((crc << 1) ^ CRC16_SNIFF_POLY)
+                                 : (unsigned short)(crc << 1) ;
+        }
+    }
+    sniffer->data = crc ;
+}
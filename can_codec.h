@@ -0,0 +1,336 @@
+// =======================================================================
+// can_codec.h
+// =======================================================================
+// Frame encoding helpers for the CAN bus (checksum, bit stuffing,
+// destuffing and frame decoding). These
+// routines do not touch the PIO/DMA hardware, so they also build on a
+// host machine.
+
+#ifndef CAN_CODEC_H
+#define CAN_CODEC_H
+
+// ----------------------------------------------------------------------
+// Checksum parameters
+// ----------------------------------------------------------------------
+
+// Set to 1 to checksum frames with the DMA sniffer (see can.cpp). The
+// sniffer only implements CRC-16-CCITT, so this changes the polynomial
+// and every node on the bus must be built the same way.
+#ifndef CAN_CRC_SNIFF
+#define CAN_CRC_SNIFF  0
+#endif
+
+// Polynomial used by the DMA sniffer in CRC16 mode
+#define CRC16_SNIFF_POLY 0x1021
+
+// Checksum polynomial and initial value
+#if CAN_CRC_SNIFF
+#define CRC16_POLY     CRC16_SNIFF_POLY
+#else
+#define CRC16_POLY     0x8005
+#endif
+#define CRC_INIT       0xFFFF
+
+// ----------------------------------------------------------------------
+// Table-driven CRC16 (MSB first, no reflection, no final XOR)
+// ----------------------------------------------------------------------
+
+// t[0] is the classic byte-wise table. t[k] advances an entry of t[k-1]
+// by one more zero byte, which lets us fold 2 or 4 message bytes into the
+// checksum with independent lookups.
+struct crc16_tables {
+    unsigned short t[4][256] ;
+} ;
+
+// Kept non-const so that the tables live in RAM (no XIP stalls in ISRs)
+extern crc16_tables crc16 ;
+
+// One byte
+static inline unsigned short crc16_byte(unsigned short crc, unsigned char data) {
+    return (unsigned short)((crc << 8) ^ crc16.t[0][((crc >> 8) ^ data) & 0xFF]) ;
+}
+
+// One 16-bit word, high byte first
+static inline unsigned short crc16_short(unsigned short crc, unsigned short data) {
+    crc ^= data ;
+    return (unsigned short)(crc16.t[1][(crc >> 8) & 0xFF] ^
+                            crc16.t[0][crc & 0xFF]) ;
+}
+
+// One 32-bit word, most significant byte first
+static inline unsigned short crc16_word(unsigned short crc, unsigned int data) {
+    data ^= ((unsigned int)crc) << 16 ;
+    return (unsigned short)(crc16.t[3][(data >> 24) & 0xFF] ^
+                            crc16.t[2][(data >> 16) & 0xFF] ^
+                            crc16.t[1][(data >> 8) & 0xFF] ^
+                            crc16.t[0][data & 0xFF]) ;
+}
+
+// Checksum over len bytes (slice-by-4, then byte-wise for the tail)
+unsigned short crc16_bytes(unsigned short crc, const unsigned char * data, int len) ;
+
+// Checksum over len 16-bit words, each one high byte first
+unsigned short crc16_shorts(unsigned short crc, const unsigned short * data, int len) ;
+
+// ----------------------------------------------------------------------
+// Table-driven bit stuffer
+// ----------------------------------------------------------------------
+
+// Bits go out MSB first. After five equal bits the complement is
+// inserted, and that stuff bit starts the next run. The run-length state
+// is 0 before the first bit, else 1 + 4*(last bit) + (run length - 1).
+#define STUFF_STATES    9
+
+// t[state][byte] packs the stuffed bits for one input byte:
+//   bits 0-9   stuffed bits, right aligned
+//   bits 10-11 number of stuff bits added (0-2)
+//   bits 12-15 run-length state after the byte
+struct stuff_tables {
+    unsigned short t[STUFF_STATES][256] ;
+} ;
+
+// In RAM, like the CRC tables
+extern stuff_tables can_stuff ;
+
+// Output side of the stuffer, carried from byte to byte
+struct can_stuffer {
+    unsigned int acc ;      // pending output bits, right aligned
+    int bits ;              // number of pending bits (< 16 between calls)
+    unsigned short * out ;  // next output word
+    unsigned char state ;   // run-length state
+} ;
+
+static inline void can_stuff_begin(can_stuffer * st, unsigned short * out) {
+    st->acc   = 0 ;
+    st->bits  = 0 ;
+    st->out   = out ;
+    st->state = 0 ;
+}
+
+// Stuff one input byte, writing out each output word as it fills
+static inline void can_stuff_byte(can_stuffer * st, unsigned char data) {
+    unsigned short entry = can_stuff.t[st->state][data] ;
+    int n = 8 + ((entry >> 10) & 0x3) ;
+    st->acc    = (st->acc << n) | (entry & 0x3FF) ;
+    st->bits  += n ;
+    st->state  = entry >> 12 ;
+    if (st->bits >= 16) {
+        st->bits -= 16 ;
+        *st->out++ = (unsigned short)(st->acc >> st->bits) ;
+    }
+}
+
+// Pad the last word with zeros (a whole zero word if we ended on a word
+// boundary), then append the all-ones EOF word. Returns the word count.
+static inline int can_stuff_end(can_stuffer * st, unsigned short * start) {
+    *st->out++ = (unsigned short)(st->acc << (16 - st->bits)) ;
+    *st->out++ = 0xFFFF ;
+    return (int)(st->out - start) ;
+}
+
+// Stuff nwords 16-bit words (high byte first) into stuffed, followed by
+// the padding and EOF word. Returns the number of words written.
+int can_bit_stuff(const unsigned short * words, int nwords, unsigned short * stuffed) ;
+
+// ----------------------------------------------------------------------
+// Single-pass frame encoder
+// ----------------------------------------------------------------------
+
+// Checksums and stuffs the frame as it is fed in, so header and payload
+// are read exactly once
+struct can_encoder {
+    can_stuffer st ;
+    unsigned short crc ;    // checksum of everything fed so far
+} ;
+
+static inline void can_encode_begin(can_encoder * enc, unsigned short * out) {
+    can_stuff_begin(&enc->st, out) ;
+    enc->crc = CRC_INIT ;
+}
+
+static inline void can_encode_byte(can_encoder * enc, unsigned char data) {
+    enc->crc = crc16_byte(enc->crc, data) ;
+    can_stuff_byte(&enc->st, data) ;
+}
+
+// One 16-bit word, high byte first
+static inline void can_encode_short(can_encoder * enc, unsigned short data) {
+    enc->crc = crc16_short(enc->crc, data) ;
+    can_stuff_byte(&enc->st, (unsigned char)(data >> 8)) ;
+    can_stuff_byte(&enc->st, (unsigned char)(data)) ;
+}
+
+// Carries on from a saved encoder whose output went to saved_start:
+// copies the words it wrote to out and continues writing after them.
+// Lets a frame prefix that rarely changes be encoded once.
+static inline void can_encode_resume(can_encoder * enc, const can_encoder * saved,
+                                     const unsigned short * saved_start, unsigned short * out) {
+    int n = (int)(saved->st.out - saved_start) ;
+    for (int i = 0; i < n; i++) {
+        out[i] = saved_start[i] ;
+    }
+    *enc = *saved ;
+    enc->st.out = out + n ;
+}
+
+// Appends the checksum, padding and EOF word. Returns the word count.
+static inline int can_encode_end(can_encoder * enc, unsigned short * start) {
+    can_stuff_byte(&enc->st, (unsigned char)(enc->crc >> 8)) ;
+    can_stuff_byte(&enc->st, (unsigned char)(enc->crc)) ;
+    return can_stuff_end(&enc->st, start) ;
+}
+
+// ----------------------------------------------------------------------
+// Table-driven destuffer
+// ----------------------------------------------------------------------
+
+// DFA over the stuffed bit stream. States 0-8 match the stuffer; states
+// 9 and 10 mean five equal bits of value (state - 9) were just seen and
+// the next bit is a stuff bit, which must be the complement.
+#define DESTUFF_STATES  11
+
+// t[state][byte] packs the result of consuming one stuffed byte:
+//   bits 0-7   data bits, right aligned
+//   bits 8-11  number of data bits
+//   bits 12-15 state after the byte, or DESTUFF_ERROR if the byte broke
+//              the stuffing rule (six equal bits). The data bits are then
+//              the ones that came before the offending bit.
+#define DESTUFF_ERROR   15
+
+struct destuff_tables {
+    unsigned short t[DESTUFF_STATES][256] ;
+} ;
+
+// In RAM, like the CRC tables
+extern destuff_tables can_destuff ;
+
+// Input side of the destuffer, carried from byte to byte
+struct can_destuffer {
+    unsigned int acc ;      // pending data bits, right aligned
+    int bits ;              // number of pending bits
+    unsigned char state ;   // DFA state
+} ;
+
+static inline void can_destuff_begin(can_destuffer * ds) {
+    ds->acc   = 0 ;
+    ds->bits  = 0 ;
+    ds->state = 0 ;
+}
+
+// Consume one stuffed byte. Returns 0 on a stuff-rule violation, after
+// which the destuffer must not be fed again, else 1.
+static inline int can_destuff_byte(can_destuffer * ds, unsigned char data) {
+    unsigned short entry = can_destuff.t[ds->state][data] ;
+    int n = (entry >> 8) & 0xF ;
+    ds->acc    = (ds->acc << n) | (entry & 0xFF) ;
+    ds->bits  += n ;
+    ds->state  = entry >> 12 ;
+    return ds->state != DESTUFF_ERROR ;
+}
+
+// Pop one whole data byte, if there is one. Returns 1 on success.
+static inline int can_destuff_pop(can_destuffer * ds, unsigned char * data) {
+    if (ds->bits < 8) {
+        return 0 ;
+    }
+    ds->bits -= 8 ;
+    *data = (unsigned char)(ds->acc >> ds->bits) ;
+    return 1 ;
+}
+
+// Destuff until the all-ones EOF byte, the end of either buffer or a
+// stuff-rule violation. Returns the number of whole bytes written and
+// sets *violation if decoding stopped on a violation. A trailing partial
+// byte at EOF is written zero-padded but not counted.
+int can_bit_unstuff(const unsigned char * stuffed, int stuffed_len,
+                    unsigned char * unstuffed, int unstuffed_len, int * violation) ;
+
+// ----------------------------------------------------------------------
+// Acceptance filter
+// ----------------------------------------------------------------------
+
+// One bit per 16-bit ID, so any mix of exact IDs, mask/ID pairs and ranges
+// costs a single lookup per frame. hi has a bit for each high ID byte
+// under which some ID is accepted, so most foreign frames can be turned
+// away after their first byte.
+#define CAN_ID_COUNT    65536
+
+struct can_filter {
+    unsigned int ids[CAN_ID_COUNT / 32] ;
+    unsigned int hi[256 / 32] ;
+} ;
+
+static inline int can_filter_hi(const can_filter * filter, unsigned char hi) {
+    return (filter->hi[hi >> 5] >> (hi & 31)) & 1 ;
+}
+
+static inline int can_filter_match(const can_filter * filter, unsigned short id) {
+    return (filter->ids[id >> 5] >> (id & 31)) & 1 ;
+}
+
+// Accepts nothing
+void can_filter_clear(can_filter * filter) ;
+
+// Accepts id
+void can_filter_add_id(can_filter * filter, unsigned short id) ;
+
+// Accepts every ID that equals id in the bits set in mask (a zero mask
+// accepts everything)
+void can_filter_add_mask(can_filter * filter, unsigned short id, unsigned short mask) ;
+
+// Accepts first to last, inclusive
+void can_filter_add_range(can_filter * filter, unsigned short first, unsigned short last) ;
+
+// Stops accepting id, however it was added
+void can_filter_remove_id(can_filter * filter, unsigned short id) ;
+
+// ----------------------------------------------------------------------
+// Single-pass frame decoder
+// ----------------------------------------------------------------------
+
+// Unstuffed frame layout: ID (2 bytes), reserve byte, payload length,
+// payload, checksum (2 bytes, over everything before it)
+#define FRAME_HEADER_LEN  4
+#define FRAME_CRC_LEN     2
+
+enum can_rx_status {
+    RX_OK,              // frame is for us and intact
+    RX_NOT_FOR_US,      // ID did not match (decoding stopped there)
+    RX_BAD_LENGTH,      // payload length field too large
+    RX_STUFF_ERROR,     // stuffing violation or EOF before the frame ended
+    RX_BAD_CRC          // checksum mismatch
+} ;
+
+// Destuffs a received frame into unstuffed while checking it, and stops
+// as soon as the outcome is known: after the ID bytes for frames that
+// filter does not accept, after the length byte for oversized frames. The
+// checksum is accumulated on the fly; pass check_crc = 0 to leave it to
+// the caller (the frame is then RX_OK once all of it has arrived).
+can_rx_status can_decode_frame(const unsigned char * stuffed, int stuffed_len,
+                               unsigned char * unstuffed, int max_payload,
+                               const can_filter * filter, int check_crc) ;
+
+// ----------------------------------------------------------------------
+// Software model of the DMA sniffer (CRC16-CCITT mode)
+// ----------------------------------------------------------------------
+
+// Mirrors SNIFF_DATA/SNIFF_CTRL so that the checksum and byte order used
+// with the hardware can be checked on a host. Each transfer is fed to the
+// CRC most significant byte first; BSWAP reverses the bytes of 16/32-bit
+// transfers before they reach the CRC. The polynomial is fixed in
+// hardware, so the model does not use the tables above.
+struct crc16_sniffer {
+    unsigned int data ;     // accumulator, CRC in bits 15:0
+    bool bswap ;            // byte swap enable
+} ;
+
+// Equivalent of dma_sniffer_set_data_accumulator/set_byte_swap_enabled
+static inline void crc16_sniff_seed(crc16_sniffer * sniffer, unsigned short seed, bool bswap) {
+    sniffer->data  = seed ;
+    sniffer->bswap = bswap ;
+}
+
+// One DMA transfer of size bytes (1, 2 or 4) holding value
+void crc16_sniff_transfer(crc16_sniffer * sniffer, unsigned int value, int size) ;
+
+#endif  // CAN_CODEC_H
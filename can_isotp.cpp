@@ -0,0 +1,344 @@
+#include "can_isotp.h"
+#include "hardware/timer.h"
+#include <string.h>
+
+
+// ----------------------------------------------------------------------
+// Link setup
+// ----------------------------------------------------------------------
+
+// Where the outgoing message is up to
+enum isotp_tx_phase {
+    TP_NONE,            // every frame queued
+    TP_FIRST,           // single or first frame still to go
+    TP_WAIT_FC,         // waiting for the receiver's flow control
+    TP_CONSECUTIVE      // sending a block of consecutive frames
+} ;
+
+// Driver callbacks carry a context, which is the link
+static void isotp_rx_callback(const unsigned char * data, int len, void * context) {
+    ((ISOTP *)context)->frameReceived(data, len) ;
+}
+
+static void isotp_tx_callback(const can_tx_record * record, void * context) {
+    ((ISOTP *)context)->frameSent(record) ;
+}
+
+ISOTP::ISOTP( CAN * can, unsigned short peer, unsigned char block_size, unsigned char st_min )
+    : can( can ),
+      peer( peer ),
+      block_size( block_size ),
+      st_min( st_min ),
+      tx_data( NULL ),
+      tx_len( 0 ),
+      tx_pos( 0 ),
+      tx_sn( 0 ),
+      tx_phase( TP_NONE ),
+      tx_status( ISOTP_IDLE ),
+      tx_block( 0 ),
+      tx_gap_us( 0 ),
+      tx_next_us( 0 ),
+      tx_wait_us( 0 ),
+      tx_outstanding( 0 ),
+      fc_received( false ),
+      fc_status( 0 ),
+      fc_block_size( 0 ),
+      fc_st_min( 0 ),
+      rx_buffer( NULL ),
+      rx_size( 0 ),
+      rx_len( 0 ),
+      rx_pos( 0 ),
+      rx_sn( 0 ),
+      rx_status( ISOTP_IDLE ),
+      rx_block( 0 ),
+      rx_last_us( 0 ),
+      fc_pending( -1 )
+{
+    lock = spin_lock_instance(next_striped_spin_lock_num()) ;
+    can->set_rx_callback(isotp_rx_callback, this) ;
+}
+
+// STmin codes: 0-127 ms, or 100-900 us for 0xF1-0xF9. Anything else is
+// reserved and read as the longest gap.
+uint64_t ISOTP::separationTime( unsigned char st_min ) {
+    if (st_min <= 0x7F) {
+        return 1000ull * st_min ;
+    }
+    if ((st_min >= 0xF1) && (st_min <= 0xF9)) {
+        return 100ull * (st_min - 0xF0) ;
+    }
+    return 127000ull ;
+}
+
+// ----------------------------------------------------------------------
+// Sending
+// ----------------------------------------------------------------------
+
+bool ISOTP::send( const unsigned char * data, unsigned int len ) {
+    if ((len == 0) || (len > ISOTP_MAX_LEN)) {
+        return false ;
+    }
+    uint32_t save = spin_lock_blocking(lock) ;
+    if (tx_status == ISOTP_BUSY) {
+        spin_unlock(lock, save) ;
+        return false ;
+    }
+    tx_data        = data ;
+    tx_len         = len ;
+    tx_pos         = 0 ;
+    tx_sn          = 1 ;
+    tx_next_us     = 0 ;
+    tx_gap_us      = 0 ;
+    fc_received    = false ;
+    tx_phase       = TP_FIRST ;
+    tx_status      = ISOTP_BUSY ;
+    spin_unlock(lock, save) ;
+
+    // Get the first frame going straight away
+    poll() ;
+    return true ;
+}
+
+void ISOTP::poll() {
+    uint64_t now = time_us_64() ;
+
+    uint32_t save = spin_lock_blocking(lock) ;
+    // The sender went quiet in the middle of a message
+    if ((rx_status == ISOTP_BUSY) && (now - rx_last_us > ISOTP_TIMEOUT_US)) {
+        rx_status = ISOTP_ERROR ;
+    }
+    // Flow control from the receiver
+    if (tx_phase == TP_WAIT_FC) {
+        if (fc_received) {
+            fc_received = false ;
+            if (fc_status == ISOTP_CTS) {
+                tx_block   = fc_block_size ;
+                tx_gap_us  = separationTime(fc_st_min) ;
+                tx_next_us = now ;
+                tx_phase   = TP_CONSECUTIVE ;
+            } else if (fc_status == ISOTP_WAIT) {
+                tx_wait_us = now ;
+            } else {
+                tx_phase  = TP_NONE ;
+                tx_status = ISOTP_ERROR ;
+            }
+        } else if (now - tx_wait_us > ISOTP_TIMEOUT_US) {
+            tx_phase  = TP_NONE ;
+            tx_status = ISOTP_ERROR ;
+        }
+    }
+    spin_unlock(lock, save) ;
+
+    // Flow control we owe the sender. Only this core takes TX slots, so a
+    // free one stays free until we use it.
+    if ((fc_pending >= 0) && (can->get_tx_space() > 0)) {
+        save = spin_lock_blocking(lock) ;
+        int flow_status = fc_pending ;
+        fc_pending = -1 ;
+        spin_unlock(lock, save) ;
+        if (flow_status >= 0) {
+            sendFlow((unsigned char)flow_status) ;
+        }
+    }
+
+    // As many segments as there are free slots, once the gap has passed
+    while (((tx_phase == TP_FIRST) || (tx_phase == TP_CONSECUTIVE)) &&
+           (can->get_tx_space() > 0) && (now >= tx_next_us)) {
+        sendNext(now) ;
+    }
+}
+
+// Queues the single/first frame or the next consecutive frame
+void ISOTP::sendNext( uint64_t now ) {
+    can_frame frame ;
+    frame.arbitration = peer ;
+
+    uint32_t save = spin_lock_blocking(lock) ;
+    if (tx_phase == TP_FIRST) {
+        if (tx_len <= ISOTP_SF_DATA) {
+            frame.data[0] = (ISOTP_SINGLE << 4) | tx_len ;
+            memcpy(&frame.data[1], tx_data, tx_len) ;
+            frame.len = 1 + tx_len ;
+            tx_pos    = tx_len ;
+        } else {
+            // With a payload capacity above 17 a message can be too long
+            // for a single frame yet fit in the first frame
+            unsigned int n = (tx_len < ISOTP_FF_DATA) ? tx_len : ISOTP_FF_DATA ;
+            frame.data[0] = (ISOTP_FIRST << 4) | (tx_len >> 8) ;
+            frame.data[1] = tx_len & 0xFF ;
+            memcpy(&frame.data[2], tx_data, n) ;
+            frame.len = 2 + n ;
+            tx_pos    = n ;
+        }
+    } else if (tx_phase == TP_CONSECUTIVE) {
+        unsigned int n = tx_len - tx_pos ;
+        if (n > ISOTP_CF_DATA) {
+            n = ISOTP_CF_DATA ;
+        }
+        frame.data[0] = (ISOTP_CONSECUTIVE << 4) | tx_sn ;
+        memcpy(&frame.data[1], &tx_data[tx_pos], n) ;
+        frame.len = 1 + n ;
+        tx_pos   += n ;
+        tx_sn     = (tx_sn + 1) & 0xF ;
+    } else {
+        // Aborted since the caller looked
+        spin_unlock(lock, save) ;
+        return ;
+    }
+
+    if (tx_pos == tx_len) {
+        // Done once the driver confirms the last frame
+        tx_phase = TP_NONE ;
+    } else if ((tx_phase == TP_FIRST) || ((tx_block > 0) && (--tx_block == 0))) {
+        tx_phase   = TP_WAIT_FC ;
+        tx_wait_us = now ;
+    }
+    tx_next_us = now + tx_gap_us ;
+    tx_outstanding += 1 ;
+    spin_unlock(lock, save) ;
+
+    can->send_async(&frame, isotp_tx_callback, this) ;
+}
+
+void ISOTP::sendFlow( unsigned char flow_status ) {
+    can_frame frame ;
+    frame.arbitration = peer ;
+    frame.data[0] = (ISOTP_FLOW << 4) | flow_status ;
+    frame.data[1] = block_size ;
+    frame.data[2] = st_min ;
+    frame.len = 3 ;
+    can->send_async(&frame, NULL, NULL) ;
+}
+
+// A segment left (or failed to). The message is done when the last one
+// has gone out.
+void ISOTP::frameSent( const can_tx_record * record ) {
+    uint32_t save = spin_lock_blocking(lock) ;
+    tx_outstanding -= 1 ;
+    if (tx_status == ISOTP_BUSY) {
+        if (record->status != TX_DONE) {
+            tx_phase  = TP_NONE ;
+            tx_status = ISOTP_ERROR ;
+        } else if ((tx_phase == TP_NONE) && (tx_outstanding == 0)) {
+            tx_status = ISOTP_DONE ;
+        }
+    }
+    spin_unlock(lock, save) ;
+}
+
+// ----------------------------------------------------------------------
+// Receiving
+// ----------------------------------------------------------------------
+
+void ISOTP::receive( unsigned char * buffer, unsigned int size ) {
+    uint32_t save = spin_lock_blocking(lock) ;
+    rx_buffer = buffer ;
+    rx_size   = size ;
+    rx_len    = 0 ;
+    rx_pos    = 0 ;
+    rx_status = ISOTP_IDLE ;
+    spin_unlock(lock, save) ;
+}
+
+// Every frame from the driver, from its RX worker (processReceived, in
+// thread context): data segments are copied into the lent buffer, flow
+// control is handed to the sending side
+void ISOTP::frameReceived( const unsigned char * data, int len ) {
+    if (len < 1) {
+        return ;
+    }
+    uint64_t now = time_us_64() ;
+
+    uint32_t save = spin_lock_blocking(lock) ;
+    bool ready = (rx_buffer != NULL) &&
+                 ((rx_status == ISOTP_IDLE) || (rx_status == ISOTP_BUSY)) ;
+    switch (data[0] >> 4) {
+    case ISOTP_SINGLE: {
+        // A new message replaces one half received
+        unsigned int n = data[0] & 0xF ;
+        if (!ready || (n == 0) || ((int)n > len - 1)) {
+            break ;
+        }
+        if (n > rx_size) {
+            rx_status = ISOTP_ERROR ;
+            break ;
+        }
+        memcpy(rx_buffer, &data[1], n) ;
+        rx_len    = n ;
+        rx_pos    = n ;
+        rx_status = ISOTP_DONE ;
+        break ;
+    }
+    case ISOTP_FIRST: {
+        if (len < 3) {
+            break ;
+        }
+        unsigned int total = ((data[0] & 0xF) << 8) | data[1] ;
+        if (total <= ISOTP_SF_DATA) {
+            break ;
+        }
+        if (!ready || (total > rx_size)) {
+            // Tell the sender to give up rather than let it time out
+            fc_pending = ISOTP_OVERFLOW ;
+            if (ready) {
+                rx_status = ISOTP_ERROR ;
+            }
+            break ;
+        }
+        // A sender with a larger payload capacity may fit (or, if broken,
+        // overrun) the whole message in its first frame
+        unsigned int n = len - 2 ;
+        if (n > total) {
+            n = total ;
+        }
+        memcpy(rx_buffer, &data[2], n) ;
+        rx_len     = total ;
+        rx_pos     = n ;
+        if (rx_pos == rx_len) {
+            rx_status = ISOTP_DONE ;
+            break ;
+        }
+        rx_sn      = 1 ;
+        rx_block   = block_size ;
+        rx_last_us = now ;
+        rx_status  = ISOTP_BUSY ;
+        fc_pending = ISOTP_CTS ;
+        break ;
+    }
+    case ISOTP_CONSECUTIVE: {
+        if (rx_status != ISOTP_BUSY) {
+            break ;
+        }
+        if ((data[0] & 0xF) != rx_sn) {
+            // Lost a frame
+            rx_status = ISOTP_ERROR ;
+            break ;
+        }
+        unsigned int n = len - 1 ;
+        if (n > rx_len - rx_pos) {
+            n = rx_len - rx_pos ;
+        }
+        memcpy(&rx_buffer[rx_pos], &data[1], n) ;
+        rx_pos    += n ;
+        rx_sn      = (rx_sn + 1) & 0xF ;
+        rx_last_us = now ;
+        if (rx_pos == rx_len) {
+            rx_status = ISOTP_DONE ;
+        } else if ((block_size > 0) && (--rx_block == 0)) {
+            // End of block: let the next one come
+            rx_block   = block_size ;
+            fc_pending = ISOTP_CTS ;
+        }
+        break ;
+    }
+    case ISOTP_FLOW:
+        if ((tx_phase == TP_WAIT_FC) && (len >= 3)) {
+            fc_status     = data[0] & 0xF ;
+            fc_block_size = data[1] ;
+            fc_st_min     = data[2] ;
+            fc_received   = true ;
+        }
+        break ;
+    }
+    spin_unlock(lock, save) ;
+}
@@ -0,0 +1,124 @@
+// =======================================================================
+// can_isotp.h
+// =======================================================================
+// Segmented transfers on top of the CAN driver, after ISO-TP (ISO
+// 15765-2). Messages longer than one frame go out as a first frame and
+// consecutive frames, paced by flow control from the receiver (block size
+// and separation time), and are reassembled straight into a buffer lent
+// by the receiving application.
+
+#ifndef CAN_ISOTP_H
+#define CAN_ISOTP_H
+
+#include "hardware/sync.h"
+#include "can.h"
+
+// ----------------------------------------------------------------------
+// Protocol parameters
+// ----------------------------------------------------------------------
+
+// Frame type, in the high nibble of the first payload byte
+#define ISOTP_SINGLE        0x0
+#define ISOTP_FIRST         0x1
+#define ISOTP_CONSECUTIVE   0x2
+#define ISOTP_FLOW          0x3
+
+// Flow status, in the low nibble of a flow control frame
+#define ISOTP_CTS           0       // clear to send the next block
+#define ISOTP_WAIT          1       // hold on, another flow control follows
+#define ISOTP_OVERFLOW      2       // message does not fit, give up
+
+// Data bytes carried by each frame type (a single frame's length is a
+// nibble)
+#define ISOTP_SF_DATA       ((MAX_PAYLOAD_SIZE > 16) ? 15 : (MAX_PAYLOAD_SIZE - 1))
+#define ISOTP_FF_DATA       (MAX_PAYLOAD_SIZE - 2)
+#define ISOTP_CF_DATA       (MAX_PAYLOAD_SIZE - 1)
+
+// Longest message (12-bit length in the first frame)
+#define ISOTP_MAX_LEN       4095
+
+// How long either side waits for the other's next frame (microseconds)
+#define ISOTP_TIMEOUT_US    1000000
+
+static_assert(MAX_PAYLOAD_SIZE >= 3, "a first frame needs room for its length and some data") ;
+
+// State of a message in either direction
+enum isotp_status {
+    ISOTP_IDLE,         // nothing going on (receive: armed, no message yet)
+    ISOTP_BUSY,         // segments still to come
+    ISOTP_DONE,         // whole message sent, or received into the buffer
+    ISOTP_ERROR         // aborted: timeout, overflow, lost frame or TX failure
+} ;
+
+// ----------------------------------------------------------------------
+// Segmented link to one peer
+// ----------------------------------------------------------------------
+
+class ISOTP {
+  public:
+    // Talks to the node with arbitration peer. block_size and st_min are
+    // what this end asks of a sender (consecutive frames per flow control,
+    // 0 for all of them, and the ISO-TP STmin code for the gap between
+    // them). Takes over the driver's receive callback.
+    ISOTP( CAN * can, unsigned short peer, unsigned char block_size, unsigned char st_min );
+
+    // Starts sending len bytes (up to ISOTP_MAX_LEN), which must stay put
+    // until the TX status leaves ISOTP_BUSY. Returns false if a message is
+    // still going out. Call from the core that services tx_handler.
+    bool send( const unsigned char * data, unsigned int len );
+    isotp_status get_tx_status() { return tx_status; }
+
+    // Lends a buffer for the next incoming message. The RX status goes
+    // to ISOTP_DONE once it is all there; call again for the one after.
+    void receive( unsigned char * buffer, unsigned int size );
+    isotp_status get_rx_status() { return rx_status; }
+    unsigned int get_rx_len() { return rx_len; }
+
+    // Sends whatever the link owes: flow control for the incoming message
+    // and the next segments of the outgoing one. Call often from the core
+    // that services tx_handler.
+    void poll();
+
+    // Driver callbacks
+    void frameReceived( const unsigned char * data, int len );
+    void frameSent( const can_tx_record * record );
+
+  protected:
+    void sendNext( uint64_t now );
+    void sendFlow( unsigned char flow_status );
+    static uint64_t separationTime( unsigned char st_min );
+
+    CAN * can;
+    unsigned short peer;
+    unsigned char block_size, st_min;
+
+    // Shared between the receiving core and the sending core
+    spin_lock_t * lock;
+
+    // Outgoing message: where it is up to, the flow control it is waiting
+    // for or working through, and frames queued but not yet confirmed
+    const unsigned char * tx_data;
+    unsigned int tx_len, tx_pos;
+    unsigned char tx_sn;
+    volatile unsigned char tx_phase;
+    volatile isotp_status tx_status;
+    int tx_block;                   // frames left in this block (0: unlimited)
+    uint64_t tx_gap_us;             // separation time asked for by the receiver
+    uint64_t tx_next_us;            // earliest time for the next frame
+    uint64_t tx_wait_us;            // when we started waiting for flow control
+    int tx_outstanding;
+    volatile bool fc_received;
+    unsigned char fc_status, fc_block_size, fc_st_min;
+
+    // Incoming message: the lent buffer, progress, and the flow control
+    // we owe the sender (-1 if none)
+    unsigned char * rx_buffer;
+    unsigned int rx_size, rx_len, rx_pos;
+    unsigned char rx_sn;
+    volatile isotp_status rx_status;
+    int rx_block;
+    uint64_t rx_last_us;            // when the last segment arrived
+    volatile int fc_pending;
+};
+
+#endif  // CAN_ISOTP_H